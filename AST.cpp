@@ -1,50 +1,239 @@
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
-#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Target/TargetMachine.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
+#include "llvm/Transforms/Vectorize/SLPVectorizer.h"
+#include <cmath>
 #include <map>
+#include <mutex>
 #include "Parser.h"
+#include "Lexer.h"
 #include "Common.h"
+#include "Profile.h"
 
 using namespace llvm;
 
 std::unique_ptr<llvm::orc::HadiJIT> myJIT;
-std::unique_ptr<LLVMContext> ctx;
-static std::unique_ptr<IRBuilder<>> builder;
-std::unique_ptr<Module> module;
-static map<std::string, Value *> namedValues;
-static std::unique_ptr<legacy::FunctionPassManager> functionPassManager;
+llvm::ExitOnError exitOnError;
+static std::vector<std::unique_ptr<PrototypeAST>> functionProtos;
+static std::vector<std::shared_ptr<FunctionExpressionAST>> functionDefinitions;
+static std::mutex functionProtosMutex;
+
+// A clone of a definition with some arguments bound to constants, declared
+// at a call site and generated once the calling function is done.
+struct Specialization
+{
+    Function *clone;
+    std::shared_ptr<FunctionExpressionAST> definition;
+    std::vector<Constant *> boundArgs;
+};
+
+// The IR generation state of one thread. Threads compile into their own
+// context and module and only share the JIT, the symbol table and the
+// prototypes above. Members are destroyed bottom-up, so everything that
+// holds types or values from the context is declared after it.
+struct CodegenSession
+{
+    std::unique_ptr<LLVMContext> ctx;
+    std::unique_ptr<Module> module;
+    std::unique_ptr<IRBuilder<>> builder;
+    // With debugInfo; the compile unit is created with the first function.
+    std::unique_ptr<DIBuilder> debugBuilder;
+    DICompileUnit *debugUnit = nullptr;
+    std::vector<AllocaInst *> namedValues;
+    std::vector<Specialization> pendingSpecializations;
+    std::unique_ptr<TargetMachine> targetMachine;
+    std::unique_ptr<LoopAnalysisManager> loopAnalysisManager;
+    std::unique_ptr<FunctionAnalysisManager> functionAnalysisManager;
+    std::unique_ptr<CGSCCAnalysisManager> cgsccAnalysisManager;
+    std::unique_ptr<ModuleAnalysisManager> moduleAnalysisManager;
+    std::unique_ptr<FunctionPassManager> functionPassManager;
+    std::unique_ptr<FunctionPassManager> mapPassManager;
+    // With --profile-use, inlines the clones of hot definitions.
+    std::unique_ptr<ModulePassManager> inlinePassManager;
+    // The definition being generated and its last profile site; see Profile.h.
+    StringRef profileFunction;
+    unsigned profileSite = 0;
+};
+
+static thread_local CodegenSession session;
+
+SymbolTable symbols;
+
+unsigned optimizationLevel = 2;
+bool timePhases = false;
+bool memoStatistics = false;
+bool debugInfo = false;
+
+static OptimizationLevel getPassBuilderOptLevel()
+{
+    switch (optimizationLevel)
+    {
+    case 0:
+        return OptimizationLevel::O0;
+    case 1:
+        return OptimizationLevel::O1;
+    case 2:
+        return OptimizationLevel::O2;
+    default:
+        return OptimizationLevel::O3;
+    }
+}
+
+CodeGenOpt::Level getCodeGenOptLevel()
+{
+    switch (optimizationLevel)
+    {
+    case 0:
+        return CodeGenOpt::None;
+    case 1:
+        return CodeGenOpt::Less;
+    case 2:
+        return CodeGenOpt::Default;
+    default:
+        return CodeGenOpt::Aggressive;
+    }
+}
 
 void initialModulesAndPassManager()
 {
-    ctx = std::make_unique<LLVMContext>();
-    module = std::make_unique<Module>("myModule", *ctx);
-    module->setDataLayout(myJIT->getDataLayout());
+    // Cached analyses of the previous module go first, each manager before
+    // the ones its proxies point into.
+    session.moduleAnalysisManager.reset();
+    session.cgsccAnalysisManager.reset();
+    session.functionAnalysisManager.reset();
+    session.loopAnalysisManager.reset();
+    session.debugBuilder.reset();
+    session.debugUnit = nullptr;
+    session.module.reset();
+    session.ctx = std::make_unique<LLVMContext>();
+    session.module = std::make_unique<Module>("myModule", *session.ctx);
+    if (myJIT)
+        session.module->setDataLayout(myJIT->getDataLayout());
+
+    session.builder = std::make_unique<IRBuilder<>>(*session.ctx);
+    if (debugInfo)
+    {
+        session.module->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+        session.module->addModuleFlag(Module::Warning, "Dwarf Version", 4);
+        session.debugBuilder = std::make_unique<DIBuilder>(*session.module);
+    }
 
-    builder = std::make_unique<IRBuilder<>>(*ctx);
+    session.loopAnalysisManager = std::make_unique<LoopAnalysisManager>();
+    session.functionAnalysisManager = std::make_unique<FunctionAnalysisManager>();
+    session.cgsccAnalysisManager = std::make_unique<CGSCCAnalysisManager>();
+    session.moduleAnalysisManager = std::make_unique<ModuleAnalysisManager>();
+
+    if (myJIT && !session.targetMachine)
+        session.targetMachine = exitOnError(myJIT->createTargetMachine());
+
+    PassBuilder passBuilder(session.targetMachine.get());
+    passBuilder.registerModuleAnalyses(*session.moduleAnalysisManager);
+    passBuilder.registerCGSCCAnalyses(*session.cgsccAnalysisManager);
+    passBuilder.registerFunctionAnalyses(*session.functionAnalysisManager);
+    passBuilder.registerLoopAnalyses(*session.loopAnalysisManager);
+    passBuilder.crossRegisterProxies(*session.loopAnalysisManager, *session.functionAnalysisManager,
+                                     *session.cgsccAnalysisManager, *session.moduleAnalysisManager);
+
+    // Variables live in allocas until mem2reg, or SROA early in the
+    // simplification pipeline, turns them back into registers. Recursion is
+    // the only way to loop without var, so every level turns tail
+    // self-calls into loops; only -O2 and up do it on their own.
+    OptimizationLevel level = getPassBuilderOptLevel();
+    if (level == OptimizationLevel::O0)
+    {
+        session.functionPassManager = std::make_unique<FunctionPassManager>();
+        session.functionPassManager->addPass(PromotePass());
+        // Folds the merge blocks of nested ifs, so their tail calls reach a ret.
+        session.functionPassManager->addPass(SimplifyCFGPass());
+        session.functionPassManager->addPass(TailCallElimPass());
+    }
+    else
+    {
+        session.functionPassManager = std::make_unique<FunctionPassManager>(
+            passBuilder.buildFunctionSimplificationPipeline(level, ThinOrFullLTOPhase::None));
+        if (level == OptimizationLevel::O1)
+            session.functionPassManager->addPass(TailCallElimPass());
+    }
 
-    functionPassManager = make_unique<legacy::FunctionPassManager>(module.get());
+    session.mapPassManager = std::make_unique<FunctionPassManager>();
+    if (level != OptimizationLevel::O0)
+    {
+        session.mapPassManager->addPass(LoopVectorizePass());
+        session.mapPassManager->addPass(SLPVectorizerPass());
+        session.mapPassManager->addPass(InstCombinePass());
+        session.mapPassManager->addPass(SimplifyCFGPass());
+    }
 
-    functionPassManager->add(createInstructionCombiningPass());
-    functionPassManager->add(createReassociatePass());
-    functionPassManager->add(createGVNPass());
-    functionPassManager->add(createCFGSimplificationPass());
+    session.inlinePassManager.reset();
+    if (level != OptimizationLevel::O0 && getProfileMaxCalls() > 0)
+    {
+        session.inlinePassManager = std::make_unique<ModulePassManager>();
+        session.inlinePassManager->addPass(passBuilder.buildInlinerPipeline(level, ThinOrFullLTOPhase::None));
+    }
+}
 
-    functionPassManager->doInitialization();
+Module &getCurrentModule()
+{
+    return *session.module;
+}
+
+orc::ThreadSafeModule takeCurrentModule()
+{
+    if (session.debugBuilder)
+    {
+        session.debugBuilder->finalize();
+        session.debugBuilder.reset();
+    }
+    return orc::ThreadSafeModule(std::move(session.module), std::move(session.ctx));
+}
+
+void optimizeModule(TargetMachine *targetMachine)
+{
+    LoopAnalysisManager loopAM;
+    FunctionAnalysisManager functionAM;
+    CGSCCAnalysisManager cgsccAM;
+    ModuleAnalysisManager moduleAM;
+
+    PassBuilder passBuilder(targetMachine);
+    passBuilder.registerModuleAnalyses(moduleAM);
+    passBuilder.registerCGSCCAnalyses(cgsccAM);
+    passBuilder.registerFunctionAnalyses(functionAM);
+    passBuilder.registerLoopAnalyses(loopAM);
+    passBuilder.crossRegisterProxies(loopAM, functionAM, cgsccAM, moduleAM);
+
+    OptimizationLevel level = getPassBuilderOptLevel();
+    ModulePassManager modulePassManager = level == OptimizationLevel::O0
+                                              ? passBuilder.buildO0DefaultPipeline(level)
+                                              : passBuilder.buildPerModuleDefaultPipeline(level);
+    modulePassManager.run(*session.module, moduleAM);
 }
 
 void initializeNativeTargets()
@@ -54,27 +243,968 @@ void initializeNativeTargets()
     InitializeNativeTargetAsmParser();
 }
 
+unsigned SymbolTable::intern(StringRef name)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto inserted = this->ids.try_emplace(name, this->names.size());
+    if (inserted.second)
+        this->names.push_back(inserted.first->getKey());
+    return inserted.first->getValue();
+}
+
+int SymbolTable::find(StringRef name) const
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto idIter = this->ids.find(name);
+    if (idIter == this->ids.end())
+        return -1;
+    return idIter->getValue();
+}
+
+StringRef SymbolTable::getName(unsigned id) const
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->names[id];
+}
+
+unsigned SymbolTable::size() const
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->names.size();
+}
+
+bool findValueType(StringRef name, ValueType &type)
+{
+    if (name == "f64")
+        type = ValueType::F64;
+    else if (name == "f32")
+        type = ValueType::F32;
+    else if (name == "i64")
+        type = ValueType::I64;
+    else
+        return false;
+    return true;
+}
+
+StringRef getValueTypeName(ValueType type)
+{
+    switch (type)
+    {
+    case ValueType::F32:
+        return "f32";
+    case ValueType::I64:
+        return "i64";
+    default:
+        return "f64";
+    }
+}
+
+bool getConversionType(unsigned name, ValueType &type)
+{
+    static const unsigned f64Name = symbols.intern("f64");
+    static const unsigned f32Name = symbols.intern("f32");
+    static const unsigned i64Name = symbols.intern("i64");
+    if (name == f64Name)
+        type = ValueType::F64;
+    else if (name == f32Name)
+        type = ValueType::F32;
+    else if (name == i64Name)
+        type = ValueType::I64;
+    else
+        return false;
+    return true;
+}
+
+// 2^63, the first double above INT64_MAX.
+static const double int64Limit = 9223372036854775808.0;
+
+int64_t toInt64(double value)
+{
+    if (std::isnan(value))
+        return 0;
+    if (value >= int64Limit)
+        return INT64_MAX;
+    if (value < -int64Limit)
+        return INT64_MIN;
+    return (int64_t)value;
+}
+
+double convertValue(ValueType type, double value)
+{
+    switch (type)
+    {
+    case ValueType::F32:
+        return (float)value;
+    case ValueType::I64:
+        return (double)toInt64(value);
+    default:
+        return value;
+    }
+}
+
+static Type *getType(ValueType type, LLVMContext &context)
+{
+    switch (type)
+    {
+    case ValueType::F32:
+        return Type::getFloatTy(context);
+    case ValueType::I64:
+        return Type::getInt64Ty(context);
+    default:
+        return Type::getDoubleTy(context);
+    }
+}
+
+static Type *getType(ValueType type)
+{
+    return getType(type, *session.ctx);
+}
+
+static FunctionType *getFunctionType(const PrototypeAST &prototype)
+{
+    std::vector<Type *> paramTypes;
+    for (ValueType type : prototype.getArgTypes())
+        paramTypes.push_back(getType(type));
+    return FunctionType::get(getType(prototype.getReturnType()), paramTypes, false);
+}
+
+static Constant *createConstant(Type *type, double value)
+{
+    if (type->isIntegerTy())
+        return ConstantInt::get(type, toInt64(value), true);
+    return ConstantFP::get(type, value);
+}
+
+// Converts value to type like convertValue does. i64 goes through the
+// saturating intrinsic, which unlike fptosi is defined for every input.
+static Value *createConversion(Value *value, Type *type)
+{
+    Type *valueType = value->getType();
+    if (valueType == type)
+        return value;
+    if (type->isIntegerTy())
+    {
+        if (auto *constant = dyn_cast<ConstantFP>(value))
+            return createConstant(type, constant->getValueAPF().convertToDouble());
+        return session.builder->CreateIntrinsic(Intrinsic::fptosi_sat, {type, valueType}, {value}, nullptr, "conv");
+    }
+    if (valueType->isIntegerTy())
+        return session.builder->CreateSIToFP(value, type, "conv");
+    return session.builder->CreateFPCast(value, type, "conv");
+}
+
+// Whether number is a literal that takes type when combined with a value
+// of it: any number for f32, a whole one for i64.
+static bool adoptsType(ExpressionAST *number, Type *type)
+{
+    double value;
+    if (!number->getConstant(value))
+        return false;
+    return type->isFloatTy() || (type->isIntegerTy() && value == std::trunc(value) && std::fabs(value) < int64Limit);
+}
+
+static unsigned getTypeRank(Type *type)
+{
+    return type->isIntegerTy() ? 0 : type->isFloatTy() ? 1 : 2;
+}
+
+// The type two operands, or the two arms of an if, are combined in. A
+// literal takes the type of the other side where it can, so x*2 stays f32
+// for an f32 x; otherwise the wider type wins, with i64 < f32 < f64.
+static Type *getCommonType(ExpressionAST *lhs, Value *lhsValue, ExpressionAST *rhs, Value *rhsValue)
+{
+    Type *lhsType = lhsValue->getType();
+    Type *rhsType = rhsValue->getType();
+    if (lhsType == rhsType)
+        return lhsType;
+    if (adoptsType(lhs, rhsType))
+        return rhsType;
+    if (adoptsType(rhs, lhsType))
+        return lhsType;
+    return getTypeRank(lhsType) > getTypeRank(rhsType) ? lhsType : rhsType;
+}
+
+// Whether value, of any type, is not zero.
+static Value *createIsTrue(Value *value, const Twine &name)
+{
+    if (value->getType()->isIntegerTy())
+        return session.builder->CreateICmpNE(value, ConstantInt::get(value->getType(), 0), name);
+    return session.builder->CreateFCmpONE(value, ConstantFP::get(value->getType(), 0.0), name);
+}
+
+static AllocaInst *&namedValue(unsigned name)
+{
+    if (name >= session.namedValues.size())
+        session.namedValues.resize(symbols.size());
+    return session.namedValues[name];
+}
+
+// Binds a name for the lifetime of a scope and restores whatever it shadowed.
+class ScopedNamedValue
+{
+    unsigned name;
+    AllocaInst *shadowed;
+
+public:
+    ScopedNamedValue(unsigned name, AllocaInst *value) : name(name), shadowed(namedValue(name))
+    {
+        namedValue(name) = value;
+    }
+    ~ScopedNamedValue() { namedValue(this->name) = this->shadowed; }
+};
+
+// Every variable gets a stack slot in the entry block of its function, where
+// mem2reg can promote it no matter which loop or branch assigns it.
+static AllocaInst *createEntryBlockAlloca(Function *function, unsigned name, Type *type)
+{
+    IRBuilder<> entryBuilder(&function->getEntryBlock(), function->getEntryBlock().begin());
+    return entryBuilder.CreateAlloca(type, nullptr, symbols.getName(name));
+}
+
+// With --profile-generate, counts one execution of a profile site: the first
+// counter if condition holds, else the second.
+static void emitProfileCount(unsigned site, Value *condition)
+{
+    if (!profileGeneration || session.profileFunction.empty())
+        return;
+
+    BranchCounts *counts = getProfileCounters(session.profileFunction, site);
+    Type *int64Type = session.builder->getInt64Ty();
+    auto counterPointer = [&](uint64_t *counter)
+    {
+        return ConstantExpr::getIntToPtr(session.builder->getInt64(reinterpret_cast<uintptr_t>(counter)),
+                                         int64Type->getPointerTo());
+    };
+
+    Value *counter = counterPointer(&counts->taken);
+    if (condition)
+        counter = session.builder->CreateSelect(condition, counter, counterPointer(&counts->notTaken), "counter");
+    Value *count = session.builder->CreateLoad(int64Type, counter, "count");
+    session.builder->CreateStore(session.builder->CreateAdd(count, session.builder->getInt64(1), "count"), counter);
+}
+
+// With --stats, counts one call of the definition being generated.
+static void emitCallCount()
+{
+    if (!collectStats || session.profileFunction.empty())
+        return;
+
+    Type *int64Type = session.builder->getInt64Ty();
+    Value *counter = ConstantExpr::getIntToPtr(
+        session.builder->getInt64(reinterpret_cast<uintptr_t>(getCallCounter(session.profileFunction))),
+        int64Type->getPointerTo());
+    Value *count = session.builder->CreateLoad(int64Type, counter, "calls");
+    session.builder->CreateStore(session.builder->CreateAdd(count, session.builder->getInt64(1), "calls"), counter);
+}
+
+static DIType *getDebugType(Type *type)
+{
+    if (type->isIntegerTy())
+        return session.debugBuilder->createBasicType("int64_t", 64, dwarf::DW_ATE_signed);
+    if (type->isFloatTy())
+        return session.debugBuilder->createBasicType("float", 32, dwarf::DW_ATE_float);
+    return session.debugBuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
+}
+
+// With debugInfo, describes function as defined on line of the source the
+// lexer reads, and points the builder at that line.
+static void beginDebugScope(Function *function, unsigned line)
+{
+    if (!session.debugBuilder)
+        return;
+
+    DIBuilder &debugBuilder = *session.debugBuilder;
+    if (!session.debugUnit)
+    {
+        StringRef path = lexer ? lexer->getSourceName() : "<stdin>";
+        DIFile *file = debugBuilder.createFile(sys::path::filename(path), sys::path::parent_path(path));
+        session.debugUnit = debugBuilder.createCompileUnit(dwarf::DW_LANG_C, file, "Band", optimizationLevel > 0, "", 0);
+    }
+
+    DIFile *file = session.debugUnit->getFile();
+    SmallVector<Metadata *, 8> types{getDebugType(function->getReturnType())};
+    for (auto &arg : function->args())
+        types.push_back(getDebugType(arg.getType()));
+    DISubprogram *subprogram = debugBuilder.createFunction(
+        file, function->getName(), StringRef(), file, line,
+        debugBuilder.createSubroutineType(debugBuilder.getOrCreateTypeArray(types)), line,
+        DINode::FlagPrototyped,
+        DISubprogram::SPFlagDefinition | (optimizationLevel > 0 ? DISubprogram::SPFlagOptimized : DISubprogram::SPFlagZero));
+    function->setSubprogram(subprogram);
+    session.builder->SetCurrentDebugLocation(DILocation::get(*session.ctx, line, 0, subprogram));
+}
+
+// Attributes the instructions generated next to line, if known.
+static void setDebugLine(unsigned line)
+{
+    DebugLoc location = session.builder->getCurrentDebugLocation();
+    if (line && location)
+        session.builder->SetCurrentDebugLocation(DILocation::get(*session.ctx, line, 0, location->getScope()));
+}
+
+static void endDebugScope(Function *function, bool generated)
+{
+    session.builder->SetCurrentDebugLocation(DebugLoc());
+    if (!function->getSubprogram())
+        return;
+    if (generated)
+        session.debugBuilder->finalizeSubprogram(function->getSubprogram());
+    else
+        function->setSubprogram(nullptr);
+}
+
+// With --profile-use, gives branch the weights of its site.
+static void setProfileWeights(unsigned site, BranchInst *branch)
+{
+    const BranchCounts *counts = findProfileCounts(session.profileFunction, site);
+    if (!counts)
+        return;
+
+    uint64_t scale = std::max(counts->taken, counts->notTaken) / UINT32_MAX + 1;
+    MDBuilder mdBuilder(*session.ctx);
+    branch->setMetadata(LLVMContext::MD_prof,
+                        mdBuilder.createBranchWeights(counts->taken / scale, counts->notTaken / scale));
+}
+
+// With --profile-use, whether definition name was called at least a tenth
+// as often as the hottest definition.
+static bool isHotDefinition(StringRef name)
+{
+    const BranchCounts *calls = findProfileCounts(name, 0);
+    return calls && calls->taken && calls->taken >= getProfileMaxCalls() / 10;
+}
+
+// With --profile-use, marks definitions that ran hot as inline candidates
+// and those that never ran as cold.
+static void setProfileCalls(Function *function)
+{
+    const BranchCounts *calls = findProfileCounts(session.profileFunction, 0);
+    if (!calls)
+        return;
+
+    function->setEntryCount(calls->taken);
+    if (!calls->taken)
+        function->addFnAttr(Attribute::Cold);
+    else if (isHotDefinition(session.profileFunction))
+    {
+        function->addFnAttr(Attribute::Hot);
+        function->addFnAttr(Attribute::InlineHint);
+    }
+}
+
+// Marks the calls whose result reaches exit, a ret or the branch into an
+// if/else merge, unchanged. Arguments are passed by value, so no callee
+// touches the caller's allocas and tail is always safe; it lets
+// TailCallElim turn self-recursion into a loop and the backend emit
+// sibling calls as jumps.
+static void markTailCalls(Value *result, Instruction *exit)
+{
+    if (auto *call = dyn_cast<CallInst>(result))
+    {
+        if (call->getNextNode() == exit)
+            call->setTailCall();
+        return;
+    }
+
+    auto *phi = dyn_cast<PHINode>(result);
+    if (!phi || phi->getParent()->getFirstNonPHI() != exit)
+        return;
+
+    for (unsigned i = 0; i < phi->getNumIncomingValues(); i++)
+    {
+        auto *branch = dyn_cast<BranchInst>(phi->getIncomingBlock(i)->getTerminator());
+        if (branch && branch->isUnconditional())
+            markTailCalls(phi->getIncomingValue(i), branch);
+    }
+}
+
 Value *logErrorValue(const char *errStr)
 {
     logError(errStr);
     return nullptr;
 }
 
+bool declareFunction(const PrototypeAST &prototype, std::shared_ptr<FunctionExpressionAST> definition)
+{
+    {
+        std::lock_guard<std::mutex> lock(functionProtosMutex);
+        unsigned name = prototype.getNameId();
+        if (name >= functionProtos.size())
+        {
+            functionProtos.resize(symbols.size());
+            functionDefinitions.resize(symbols.size());
+        }
+        if (functionProtos[name])
+        {
+            // Repeating an extern is harmless, so the REPL accepts it.
+            const PrototypeAST &declared = *functionProtos[name];
+            return declared.isExtern() && prototype.isExtern() && declared.getArgs().size() == prototype.getArgs().size();
+        }
+
+        functionProtos[name] = std::make_unique<PrototypeAST>(prototype);
+    }
+
+    // The body is folded with its own prototype registered, and only then
+    // published for other threads to specialize. Folding looks up
+    // prototypes, so it runs outside the lock.
+    if (definition)
+    {
+        definition->fold();
+        std::lock_guard<std::mutex> lock(functionProtosMutex);
+        functionDefinitions[prototype.getNameId()] = std::move(definition);
+    }
+    return true;
+}
+
+void forgetFunction(unsigned name)
+{
+    std::lock_guard<std::mutex> lock(functionProtosMutex);
+    if (name < functionProtos.size())
+    {
+        functionProtos[name].reset();
+        functionDefinitions[name].reset();
+    }
+}
+
+int getFunctionArity(unsigned name)
+{
+    std::lock_guard<std::mutex> lock(functionProtosMutex);
+    if (name >= functionProtos.size() || !functionProtos[name])
+        return -1;
+    return functionProtos[name]->getArgs().size();
+}
+
+std::string getFunctionSignature(unsigned name)
+{
+    std::lock_guard<std::mutex> lock(functionProtosMutex);
+    if (name >= functionProtos.size() || !functionProtos[name])
+        return std::string();
+    const PrototypeAST &prototype = *functionProtos[name];
+    std::string signature(1, (char)prototype.getReturnType());
+    for (ValueType type : prototype.getArgTypes())
+        signature += (char)type;
+    return signature;
+}
+
+struct MathBuiltin
+{
+    StringRef name;
+    Intrinsic::ID intrinsic;
+    int arity;
+};
+
+static const MathBuiltin mathBuiltins[] = {
+    {"sqrt", Intrinsic::sqrt, 1},
+    {"sin", Intrinsic::sin, 1},
+    {"cos", Intrinsic::cos, 1},
+    {"exp", Intrinsic::exp, 1},
+    {"exp2", Intrinsic::exp2, 1},
+    {"log", Intrinsic::log, 1},
+    {"log2", Intrinsic::log2, 1},
+    {"log10", Intrinsic::log10, 1},
+    {"fabs", Intrinsic::fabs, 1},
+    {"floor", Intrinsic::floor, 1},
+    {"ceil", Intrinsic::ceil, 1},
+    {"trunc", Intrinsic::trunc, 1},
+    {"round", Intrinsic::round, 1},
+    {"rint", Intrinsic::rint, 1},
+    {"nearbyint", Intrinsic::nearbyint, 1},
+    {"pow", Intrinsic::pow, 2},
+    {"fmin", Intrinsic::minnum, 2},
+    {"fmax", Intrinsic::maxnum, 2},
+    {"copysign", Intrinsic::copysign, 2},
+    {"fma", Intrinsic::fma, 3},
+};
+
+static const MathBuiltin *findMathBuiltin(unsigned name)
+{
+    StringRef builtinName = symbols.getName(name);
+    for (const MathBuiltin &builtin : mathBuiltins)
+        if (builtin.name == builtinName)
+            return &builtin;
+    return nullptr;
+}
+
+int getBuiltinArity(unsigned name)
+{
+    const MathBuiltin *builtin = findMathBuiltin(name);
+    return builtin ? builtin->arity : -1;
+}
+
+bool isLibraryFunction(const PrototypeAST &prototype)
+{
+    StringRef functionName = prototype.getName();
+    if (findMathBuiltin(prototype.getNameId()) || isRuntimeSymbol(functionName))
+        return true;
+
+    static const TargetLibraryInfoImpl libraryInfo(Triple(sys::getProcessTriple()));
+    LibFunc libFunc;
+    if (!libraryInfo.getLibFunc(functionName, libFunc))
+        return false;
+
+    // Only a matching signature makes LLVM treat a function as the library's.
+    LLVMContext context;
+    Module module("library", context);
+    std::vector<Type *> paramTypes;
+    for (ValueType type : prototype.getArgTypes())
+        paramTypes.push_back(getType(type, context));
+    Function *function = Function::Create(FunctionType::get(getType(prototype.getReturnType(), context), paramTypes, false),
+                                          Function::ExternalLinkage, functionName, module);
+    return libraryInfo.getLibFunc(*function, libFunc);
+}
+
+bool evaluateBuiltin(unsigned name, ArrayRef<double> args, double &result)
+{
+    const MathBuiltin *builtin = findMathBuiltin(name);
+    if (!builtin || builtin->arity != (int)args.size())
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(functionProtosMutex);
+        if (name < functionProtos.size() && functionProtos[name] && !functionProtos[name]->isExtern())
+            return false;
+    }
+
+    // The same libm functions the runtime table resolves the calls to.
+    switch (builtin->intrinsic)
+    {
+    case Intrinsic::sqrt:
+        result = sqrt(args[0]);
+        break;
+    case Intrinsic::sin:
+        result = sin(args[0]);
+        break;
+    case Intrinsic::cos:
+        result = cos(args[0]);
+        break;
+    case Intrinsic::exp:
+        result = exp(args[0]);
+        break;
+    case Intrinsic::exp2:
+        result = exp2(args[0]);
+        break;
+    case Intrinsic::log:
+        result = log(args[0]);
+        break;
+    case Intrinsic::log2:
+        result = log2(args[0]);
+        break;
+    case Intrinsic::log10:
+        result = log10(args[0]);
+        break;
+    case Intrinsic::fabs:
+        result = fabs(args[0]);
+        break;
+    case Intrinsic::floor:
+        result = floor(args[0]);
+        break;
+    case Intrinsic::ceil:
+        result = ceil(args[0]);
+        break;
+    case Intrinsic::trunc:
+        result = trunc(args[0]);
+        break;
+    case Intrinsic::round:
+        result = round(args[0]);
+        break;
+    case Intrinsic::rint:
+        result = rint(args[0]);
+        break;
+    case Intrinsic::nearbyint:
+        result = nearbyint(args[0]);
+        break;
+    case Intrinsic::pow:
+        result = pow(args[0], args[1]);
+        break;
+    case Intrinsic::minnum:
+        result = fmin(args[0], args[1]);
+        break;
+    case Intrinsic::maxnum:
+        result = fmax(args[0], args[1]);
+        break;
+    case Intrinsic::copysign:
+        result = copysign(args[0], args[1]);
+        break;
+    case Intrinsic::fma:
+        result = fma(args[0], args[1], args[2]);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+Function *getFunction(unsigned name)
+{
+    if (Function *function = session.module->getFunction(symbols.getName(name)))
+        return function;
+
+    {
+        std::lock_guard<std::mutex> lock(functionProtosMutex);
+        if (name < functionProtos.size() && functionProtos[name] && !functionProtos[name]->isExtern())
+            return functionProtos[name]->codegen();
+    }
+
+    // Declared extern or not, a builtin is called as its intrinsic so the
+    // optimizer can fold and vectorize it. Codegen lowers it to libm if
+    // needed. Definitions can not take builtin names; see isLibraryFunction.
+    if (const MathBuiltin *builtin = findMathBuiltin(name))
+        return Intrinsic::getDeclaration(session.module.get(), builtin->intrinsic,
+                                         {Type::getDoubleTy(*session.ctx)});
+
+    std::lock_guard<std::mutex> lock(functionProtosMutex);
+    if (name < functionProtos.size() && functionProtos[name])
+        return functionProtos[name]->codegen();
+
+    return nullptr;
+}
+
+Function *createArrayEntry(Function *function)
+{
+    Type *doubleType = Type::getDoubleTy(*session.ctx);
+    FunctionType *entryType = FunctionType::get(doubleType, {PointerType::getUnqual(doubleType)}, false);
+    Function *entry = Function::Create(entryType, Function::ExternalLinkage,
+                                       function->getName() + ".entry", session.module.get());
+
+    BasicBlock *basicBlock = BasicBlock::Create(*session.ctx, "entry_block", entry);
+    session.builder->SetInsertPoint(basicBlock);
+
+    Value *argArray = entry->getArg(0);
+    std::vector<Value *> argValues;
+    for (unsigned i = 0; i < function->arg_size(); i++)
+    {
+        Value *argPointer = session.builder->CreateConstInBoundsGEP1_64(doubleType, argArray, i);
+        argValues.push_back(createConversion(session.builder->CreateLoad(doubleType, argPointer, "arg"),
+                                             function->getArg(i)->getType()));
+    }
+
+    Value *result = session.builder->CreateCall(function, argValues, "callres");
+    session.builder->CreateRet(createConversion(result, doubleType));
+    verifyFunction(*entry);
+
+    return entry;
+}
+
+// Generates name(const T *a, ..., T *out, i64 rows), which evaluates
+// function with function inlined, and optimizes it for the vectorizer. The
+// columns have the parameter and result types of function, or with
+// asDoubles are doubles converted as they are loaded and stored.
+static Function *createMapLoop(Function *function, const Twine &name, bool asDoubles)
+{
+    Type *doubleType = Type::getDoubleTy(*session.ctx);
+    Type *rowsType = Type::getInt64Ty(*session.ctx);
+    unsigned argCount = function->arg_size();
+    auto getColumnType = [&](Type *type)
+    {
+        return asDoubles ? doubleType : type;
+    };
+
+    std::vector<Type *> paramTypes;
+    for (auto &arg : function->args())
+        paramTypes.push_back(PointerType::getUnqual(getColumnType(arg.getType())));
+    paramTypes.push_back(PointerType::getUnqual(getColumnType(function->getReturnType())));
+    paramTypes.push_back(rowsType);
+    FunctionType *mapType = FunctionType::get(Type::getVoidTy(*session.ctx), paramTypes, false);
+    Function *map = Function::Create(mapType, Function::ExternalLinkage, name, session.module.get());
+
+    for (unsigned i = 0; i < argCount; i++)
+        map->getArg(i)->setName(function->getArg(i)->getName());
+    map->getArg(argCount)->setName("out");
+    map->getArg(argCount + 1)->setName("rows");
+    for (unsigned i = 0; i <= argCount; i++)
+        map->addParamAttr(i, Attribute::NoAlias);
+
+    BasicBlock *entryBasicBlock = BasicBlock::Create(*session.ctx, "entry_block", map);
+    BasicBlock *loopBasicBlock = BasicBlock::Create(*session.ctx, "loop", map);
+    BasicBlock *afterloopBasicBlock = BasicBlock::Create(*session.ctx, "afterloop", map);
+
+    session.builder->SetInsertPoint(entryBasicBlock);
+    Value *rows = map->getArg(argCount + 1);
+    session.builder->CreateCondBr(session.builder->CreateICmpEQ(rows, session.builder->getInt64(0), "empty"),
+                                  afterloopBasicBlock, loopBasicBlock);
+
+    session.builder->SetInsertPoint(loopBasicBlock);
+    PHINode *row = session.builder->CreatePHI(rowsType, 2, "row");
+    row->addIncoming(session.builder->getInt64(0), entryBasicBlock);
+
+    std::vector<Value *> argValues;
+    for (unsigned i = 0; i < argCount; i++)
+    {
+        Type *argType = function->getArg(i)->getType();
+        Type *columnType = getColumnType(argType);
+        Value *argPointer = session.builder->CreateInBoundsGEP(columnType, map->getArg(i), row);
+        argValues.push_back(createConversion(session.builder->CreateLoad(columnType, argPointer, "arg"), argType));
+    }
+    CallInst *call = session.builder->CreateCall(function, argValues, "callres");
+    Type *outType = getColumnType(function->getReturnType());
+    session.builder->CreateStore(createConversion(call, outType),
+                                 session.builder->CreateInBoundsGEP(outType, map->getArg(argCount), row));
+
+    Value *nextRow = session.builder->CreateAdd(row, session.builder->getInt64(1), "nextrow", true, true);
+    row->addIncoming(nextRow, loopBasicBlock);
+    session.builder->CreateCondBr(session.builder->CreateICmpULT(nextRow, rows, "loopcond"), loopBasicBlock, afterloopBasicBlock);
+
+    session.builder->SetInsertPoint(afterloopBasicBlock);
+    session.builder->CreateRetVoid();
+    verifyFunction(*map);
+
+    {
+        StageTimer timer(CompileStage::Optimize, function->getName());
+        InlineFunctionInfo inlineInfo;
+        InlineFunction(*call, inlineInfo);
+        session.functionPassManager->run(*map, *session.functionAnalysisManager);
+        session.mapPassManager->run(*map, *session.functionAnalysisManager);
+    }
+    return map;
+}
+
+Function *createMapEntry(Function *function)
+{
+    Type *doublePointerType = PointerType::getUnqual(Type::getDoubleTy(*session.ctx));
+    Type *rowsType = Type::getInt64Ty(*session.ctx);
+    unsigned argCount = function->arg_size();
+
+    // f_map takes columns of the definition's own types. The .columns entry
+    // always takes doubles, so a typed definition gets a second loop,
+    // f_map.f64, that converts them.
+    Function *map = createMapLoop(function, function->getName() + "_map", false);
+    Function *doubleMap = map;
+    bool typed = !function->getReturnType()->isDoubleTy() ||
+                 any_of(function->args(), [](const Argument &arg)
+                        { return !arg.getType()->isDoubleTy(); });
+    if (typed)
+        doubleMap = createMapLoop(function, map->getName() + ".f64", true);
+
+    FunctionType *columnsType = FunctionType::get(
+        Type::getVoidTy(*session.ctx), {PointerType::getUnqual(doublePointerType), doublePointerType, rowsType}, false);
+    Function *columns = Function::Create(columnsType, Function::ExternalLinkage,
+                                         map->getName() + ".columns", session.module.get());
+
+    session.builder->SetInsertPoint(BasicBlock::Create(*session.ctx, "entry_block", columns));
+    std::vector<Value *> columnValues;
+    for (unsigned i = 0; i < argCount; i++)
+    {
+        Value *columnPointer = session.builder->CreateConstInBoundsGEP1_64(doublePointerType, columns->getArg(0), i);
+        columnValues.push_back(session.builder->CreateLoad(doublePointerType, columnPointer, "column"));
+    }
+    columnValues.push_back(columns->getArg(1));
+    columnValues.push_back(columns->getArg(2));
+    session.builder->CreateCall(doubleMap, columnValues);
+    session.builder->CreateRetVoid();
+    verifyFunction(*columns);
+
+    return map;
+}
+
+// Each memo def gets its own table of memoTableEntries slots. A slot holds a
+// version, the result bits and the argument bits, padded to a power of two
+// so it never straddles a cache line. The version is a seqlock: zero is
+// empty, odd is being written, so concurrent callers never see torn slots.
+// The hit and miss counters are shared by every caller, so they are only
+// emitted with memoStatistics; otherwise a hit writes no memory at all.
+static const unsigned memoTableBits = 12;
+static const unsigned memoTableEntries = 1u << memoTableBits;
+
+void createMemoEntry(Function *function, Function *compute)
+{
+    Type *int64Type = Type::getInt64Ty(*session.ctx);
+    Type *int32Type = Type::getInt32Ty(*session.ctx);
+    unsigned argCount = function->arg_size();
+    unsigned slotWords = PowerOf2Ceil(argCount + 2);
+
+    Type *slotType = ArrayType::get(int64Type, slotWords);
+    Type *tableType = ArrayType::get(slotType, memoTableEntries);
+    auto *table = new GlobalVariable(*session.module, tableType, false, GlobalValue::InternalLinkage,
+                                     Constant::getNullValue(tableType), function->getName() + ".memo.table");
+    table->setAlignment(Align(64));
+    auto createCounter = [&](const Twine &name) -> GlobalVariable *
+    {
+        if (!memoStatistics)
+            return nullptr;
+        return new GlobalVariable(*session.module, int64Type, false, GlobalValue::ExternalLinkage,
+                                  session.builder->getInt64(0), function->getName() + name);
+    };
+    auto count = [&](GlobalVariable *counter)
+    {
+        if (counter)
+            session.builder->CreateAtomicRMW(AtomicRMWInst::Add, counter, session.builder->getInt64(1), MaybeAlign(8),
+                                             AtomicOrdering::Monotonic);
+    };
+    // Arguments and results are kept as the bits of a word; an f32 in the
+    // low half.
+    auto toBits = [&](Value *value, const Twine &name) -> Value *
+    {
+        Type *type = value->getType();
+        if (type->isIntegerTy())
+            return value;
+        if (type->isFloatTy())
+            return session.builder->CreateZExt(session.builder->CreateBitCast(value, int32Type), int64Type, name);
+        return session.builder->CreateBitCast(value, int64Type, name);
+    };
+    auto fromBits = [&](Value *bits, Type *type, const Twine &name) -> Value *
+    {
+        if (type->isIntegerTy())
+            return bits;
+        if (type->isFloatTy())
+            return session.builder->CreateBitCast(session.builder->CreateTrunc(bits, int32Type), type, name);
+        return session.builder->CreateBitCast(bits, type, name);
+    };
+    GlobalVariable *hits = createCounter("_memo_hits");
+    GlobalVariable *misses = createCounter("_memo_misses");
+
+    BasicBlock *entryBasicBlock = BasicBlock::Create(*session.ctx, "entry_block", function);
+    BasicBlock *checkBasicBlock = BasicBlock::Create(*session.ctx, "check", function);
+    BasicBlock *hitBasicBlock = BasicBlock::Create(*session.ctx, "hit", function);
+    BasicBlock *missBasicBlock = BasicBlock::Create(*session.ctx, "miss", function);
+    BasicBlock *storeBasicBlock = BasicBlock::Create(*session.ctx, "store", function);
+    BasicBlock *doneBasicBlock = BasicBlock::Create(*session.ctx, "done", function);
+
+    session.builder->SetInsertPoint(entryBasicBlock);
+    const uint64_t multiplier = 0x9E3779B97F4A7C15ULL;
+    std::vector<Value *> argBits;
+    Value *hash = session.builder->getInt64(multiplier);
+    for (auto &arg : function->args())
+    {
+        argBits.push_back(toBits(&arg, arg.getName() + ".bits"));
+        hash = session.builder->CreateMul(session.builder->CreateXor(hash, argBits.back()),
+                                          session.builder->getInt64(multiplier), "hash");
+    }
+    Value *index = session.builder->CreateLShr(hash, 64 - memoTableBits, "index");
+
+    auto slotWord = [&](unsigned word)
+    {
+        return session.builder->CreateInBoundsGEP(tableType, table, {session.builder->getInt64(0), index,
+                                                                     session.builder->getInt64(word)});
+    };
+    Value *versionPointer = slotWord(0);
+    LoadInst *version = session.builder->CreateLoad(int64Type, versionPointer, "version");
+    version->setAtomic(AtomicOrdering::Acquire);
+    version->setAlignment(Align(8));
+    Value *readable = session.builder->CreateICmpEQ(session.builder->CreateAnd(version, 1), session.builder->getInt64(0));
+    readable = session.builder->CreateAnd(readable, session.builder->CreateICmpNE(version, session.builder->getInt64(0)),
+                                          "readable");
+    session.builder->CreateCondBr(readable, checkBasicBlock, missBasicBlock);
+
+    auto loadWord = [&](unsigned word, const Twine &name)
+    {
+        LoadInst *load = session.builder->CreateLoad(int64Type, slotWord(word), name);
+        load->setAtomic(AtomicOrdering::Monotonic);
+        load->setAlignment(Align(8));
+        return load;
+    };
+    auto storeWord = [&](Value *value, unsigned word)
+    {
+        StoreInst *store = session.builder->CreateStore(value, slotWord(word));
+        store->setAtomic(AtomicOrdering::Monotonic);
+        store->setAlignment(Align(8));
+        return store;
+    };
+
+    session.builder->SetInsertPoint(checkBasicBlock);
+    Value *cachedBits = loadWord(1, "cached.bits");
+    Value *matches = session.builder->getTrue();
+    for (unsigned i = 0; i < argCount; i++)
+        matches = session.builder->CreateAnd(matches, session.builder->CreateICmpEQ(loadWord(i + 2, "key"), argBits[i]));
+    session.builder->CreateFence(AtomicOrdering::Acquire);
+    LoadInst *versionAfter = session.builder->CreateLoad(int64Type, versionPointer, "version.after");
+    versionAfter->setAtomic(AtomicOrdering::Monotonic);
+    versionAfter->setAlignment(Align(8));
+    matches = session.builder->CreateAnd(matches, session.builder->CreateICmpEQ(version, versionAfter), "matches");
+    session.builder->CreateCondBr(matches, hitBasicBlock, missBasicBlock);
+
+    session.builder->SetInsertPoint(hitBasicBlock);
+    count(hits);
+    session.builder->CreateRet(fromBits(cachedBits, function->getReturnType(), "cached"));
+
+    // On a miss, compute the result and publish it unless another caller is
+    // writing the same slot; a lost update only costs a later miss.
+    session.builder->SetInsertPoint(missBasicBlock);
+    count(misses);
+    std::vector<Value *> args;
+    for (auto &arg : function->args())
+        args.push_back(&arg);
+    Value *result = session.builder->CreateCall(compute, args, "result");
+    Value *current = loadWord(0, "current");
+    Value *written = session.builder->CreateOr(current, 1, "written");
+    Value *exchange = session.builder->CreateAtomicCmpXchg(versionPointer, session.builder->CreateAnd(current, ~1ULL),
+                                                           written, MaybeAlign(8), AtomicOrdering::Acquire,
+                                                           AtomicOrdering::Monotonic);
+    session.builder->CreateCondBr(session.builder->CreateExtractValue(exchange, 1, "claimed"), storeBasicBlock,
+                                  doneBasicBlock);
+
+    session.builder->SetInsertPoint(storeBasicBlock);
+    storeWord(toBits(result, "result.bits"), 1);
+    for (unsigned i = 0; i < argCount; i++)
+        storeWord(argBits[i], i + 2);
+    storeWord(session.builder->CreateAdd(written, session.builder->getInt64(1), "published"), 0)
+        ->setOrdering(AtomicOrdering::Release);
+    session.builder->CreateBr(doneBasicBlock);
+
+    session.builder->SetInsertPoint(doneBasicBlock);
+    session.builder->CreateRet(result);
+    verifyFunction(*function);
+}
+
 Value *NumberExpAST::codegen()
 {
-    return ConstantFP::get(*ctx, APFloat(this->value));
+    return ConstantFP::get(*session.ctx, APFloat(this->value));
 }
 
 Value *VariableExpAST::codegen()
 {
-    Value *value = namedValues[this->name];
+    AllocaInst *variable = namedValue(this->name);
+
+    if (!variable)
+        return logErrorValue("Unknown variable name");
+
+    return session.builder->CreateLoad(variable->getAllocatedType(), variable, symbols.getName(this->name));
+}
 
+Value *AssignExpAST::codegen()
+{
+    Value *value = this->value->codegen();
     if (!value)
+        return nullptr;
+    setDebugLine(this->line);
+
+    AllocaInst *variable = namedValue(this->name);
+    if (!variable)
         return logErrorValue("Unknown variable name");
 
+    // A variable keeps the type it was declared with.
+    value = createConversion(value, variable->getAllocatedType());
+    session.builder->CreateStore(value, variable);
     return value;
 }
 
+Value *VarExpressionAST::codegen()
+{
+    Function *function = session.builder->GetInsertBlock()->getParent();
+
+    // Initializers see the enclosing bindings, so var a = a in ... works.
+    SmallVector<AllocaInst *, 4> shadowed;
+    Value *bodyValue = nullptr;
+    for (auto &var : this->vars)
+    {
+        Value *initValue = var.second ? var.second->codegen() : ConstantFP::get(*session.ctx, APFloat(0.0));
+        if (!initValue)
+            break;
+
+        AllocaInst *variable = createEntryBlockAlloca(function, var.first, initValue->getType());
+        session.builder->CreateStore(initValue, variable);
+        shadowed.push_back(namedValue(var.first));
+        namedValue(var.first) = variable;
+    }
+
+    if (shadowed.size() == this->vars.size())
+        bodyValue = this->body->codegen();
+
+    for (unsigned i = shadowed.size(); i-- > 0;)
+        namedValue(this->vars[i].first) = shadowed[i];
+
+    return bodyValue;
+}
+
 Value *BinaryExpAST::codegen()
 {
     Value *leftHandSide = this->lhs->codegen();
@@ -82,22 +1212,42 @@ Value *BinaryExpAST::codegen()
 
     if (!leftHandSide || !rightHandSide)
         return nullptr;
+    setDebugLine(this->line);
+
+    if (this->op == ':')
+        return rightHandSide;
+
+    // Both operands are converted to their common type, which is also the
+    // type of the result; i64 arithmetic wraps around.
+    Type *type = getCommonType(this->lhs, leftHandSide, this->rhs, rightHandSide);
+    leftHandSide = createConversion(leftHandSide, type);
+    rightHandSide = createConversion(rightHandSide, type);
+    bool integer = type->isIntegerTy();
 
     switch (this->op)
     {
     case '+':
-        return builder->CreateFAdd(leftHandSide, rightHandSide, "addres");
+        if (integer)
+            return session.builder->CreateAdd(leftHandSide, rightHandSide, "addres");
+        return session.builder->CreateFAdd(leftHandSide, rightHandSide, "addres");
 
     case '-':
-        return builder->CreateFSub(leftHandSide, rightHandSide, "subres");
+        if (integer)
+            return session.builder->CreateSub(leftHandSide, rightHandSide, "subres");
+        return session.builder->CreateFSub(leftHandSide, rightHandSide, "subres");
 
     case '*':
-        return builder->CreateFMul(leftHandSide, rightHandSide, "mulres");
+        if (integer)
+            return session.builder->CreateMul(leftHandSide, rightHandSide, "mulres");
+        return session.builder->CreateFMul(leftHandSide, rightHandSide, "mulres");
 
     case '<':
     {
-        Value *result = builder->CreateFCmpULT(leftHandSide, rightHandSide, "cmpres");
-        return builder->CreateUIToFP(result, Type::getDoubleTy(*ctx), "comres");
+        if (integer)
+            return session.builder->CreateZExt(session.builder->CreateICmpSLT(leftHandSide, rightHandSide, "cmpres"),
+                                               type, "comres");
+        Value *result = session.builder->CreateFCmpULT(leftHandSide, rightHandSide, "cmpres");
+        return session.builder->CreateUIToFP(result, type, "comres");
     }
 
     default:
@@ -105,71 +1255,279 @@ Value *BinaryExpAST::codegen()
     }
 }
 
+// Returns a clone of definition name with the constant arguments of a call
+// bound, such as foo<a=2> for foo(x, 2), declaring it on first use in the
+// module. The optimizer then folds the arithmetic on the constants in its
+// copy of the body. Without optimization that would not happen, and memo
+// defs keep a single cache, so neither is specialized. With --profile-use,
+// a hot definition other than the one being generated is cloned even with
+// no constant arguments, as foo<>, so the inliner can see its body.
+static Function *getSpecialization(unsigned name, ArrayRef<ExpressionAST *> args)
+{
+    if (optimizationLevel == 0)
+        return nullptr;
+
+    SmallVector<double, 4> values(args.size());
+    SmallVector<bool, 4> bound(args.size());
+    bool anyBound = false;
+    for (unsigned i = 0; i < args.size(); i++)
+    {
+        bound[i] = args[i]->getConstant(values[i]);
+        anyBound |= bound[i];
+    }
+    if (!anyBound && (session.profileFunction == symbols.getName(name) || !isHotDefinition(symbols.getName(name))))
+        return nullptr;
+
+    std::shared_ptr<FunctionExpressionAST> definition;
+    {
+        std::lock_guard<std::mutex> lock(functionProtosMutex);
+        if (name < functionDefinitions.size())
+            definition = functionDefinitions[name];
+    }
+    if (!definition || definition->getPrototype().isMemoized())
+        return nullptr;
+
+    // Constants are bound converted to the parameter type, so f(2.5) and
+    // f(2) share the clone f<n=2> of an i64 n.
+    const PrototypeAST &prototype = definition->getPrototype();
+    const vector<unsigned> &argNames = prototype.getArgs();
+    std::vector<Constant *> boundArgs(args.size());
+    std::string cloneName;
+    raw_string_ostream cloneNameStream(cloneName);
+    cloneNameStream << symbols.getName(name) << '<';
+    std::vector<Type *> paramTypes;
+    const char *separator = "";
+    for (unsigned i = 0; i < args.size(); i++)
+    {
+        Type *type = getType(prototype.getArgTypes()[i]);
+        if (!bound[i])
+        {
+            paramTypes.push_back(type);
+            continue;
+        }
+        double value = convertValue(prototype.getArgTypes()[i], values[i]);
+        boundArgs[i] = createConstant(type, value);
+        cloneNameStream << separator << symbols.getName(argNames[i]) << '=' << format("%.17g", value);
+        separator = ",";
+    }
+    cloneNameStream << '>';
+
+    if (Function *clone = session.module->getFunction(cloneNameStream.str()))
+        return clone;
+
+    Function *clone = Function::Create(FunctionType::get(getType(prototype.getReturnType()), paramTypes, false),
+                                       Function::InternalLinkage, cloneName, session.module.get());
+    session.pendingSpecializations.push_back({clone, std::move(definition), std::move(boundArgs)});
+    return clone;
+}
+
+// The math builtin callee computes in f32 when its arguments are f32 or
+// literals; otherwise they are converted to its f64 parameters.
+static Function *getBuiltinOverload(Function *callee, ArrayRef<ExpressionAST *> args, ArrayRef<Value *> argValues)
+{
+    Type *floatType = Type::getFloatTy(*session.ctx);
+    bool anyFloat = false;
+    for (unsigned i = 0; i < args.size(); i++)
+    {
+        if (argValues[i]->getType() == floatType)
+            anyFloat = true;
+        else if (!adoptsType(args[i], floatType))
+            return callee;
+    }
+    if (!anyFloat)
+        return callee;
+    return Intrinsic::getDeclaration(session.module.get(), callee->getIntrinsicID(), {floatType});
+}
+
 Value *CallExpressionAST::codegen()
 {
-    Function *callFunction = module->getFunction(this->funcName);
+    ValueType conversion;
+    if (getConversionType(this->funcName, conversion))
+    {
+        if (this->args.size() != 1)
+            return logErrorValue("A conversion takes one argument");
+        Value *value = this->args[0]->codegen();
+        if (!value)
+            return nullptr;
+        setDebugLine(this->line);
+        return createConversion(value, getType(conversion));
+    }
+
+    Function *callFunction = getFunction(this->funcName);
     if (!callFunction)
         return logErrorValue("Unknown function");
 
     if (callFunction->arg_size() != this->args.size())
         return logErrorValue("Incorrect number of arguments");
 
+    // A specialization takes only the arguments that are not constant.
+    Function *specialized = getSpecialization(this->funcName, this->args);
     std::vector<Value *> argValues;
-    for (int i = 0; i < callFunction->arg_size(); i++)
+    for (ExpressionAST *arg : this->args)
     {
-        argValues.push_back(this->args[i]->codegen());
+        double value;
+        if (specialized && arg->getConstant(value))
+            continue;
+
+        argValues.push_back(arg->codegen());
         if (!argValues.back())
             return nullptr;
     }
 
-    return builder->CreateCall(callFunction, argValues, "callres");
+    Function *callee = specialized ? specialized : callFunction;
+    if (callee->isIntrinsic())
+        callee = getBuiltinOverload(callee, this->args, argValues);
+
+    setDebugLine(this->line);
+    for (unsigned i = 0; i < argValues.size(); i++)
+        argValues[i] = createConversion(argValues[i], callee->getFunctionType()->getParamType(i));
+    return session.builder->CreateCall(callee, argValues, "callres");
 }
 
 Function *PrototypeAST::codegen()
 {
-    std::vector<Type *> doubles(this->args.size(), Type::getDoubleTy(*ctx));
-    FunctionType *functionType = FunctionType::get(Type::getDoubleTy(*ctx), doubles, false);
-    Function *function = Function::Create(functionType,
-                                          Function::ExternalLinkage, this->name, module.get());
+    Function *function = Function::Create(getFunctionType(*this),
+                                          Function::ExternalLinkage, this->getName(), session.module.get());
 
     unsigned index = 0;
     for (auto &arg : function->args())
-        arg.setName(this->args[index++]);
+        arg.setName(symbols.getName(this->args[index++]));
 
     return function;
 }
 
-Function *FunctionExpressionAST::codegen()
+// Generates the body into function and verifies it. An argument with a
+// constant in boundArgs is stored from the constant instead of a parameter.
+bool FunctionExpressionAST::codegenBody(Function *function, ArrayRef<Constant *> boundArgs)
 {
-    Function *function = module->getFunction(this->prototype->getName());
+    BasicBlock *basicBlock = BasicBlock::Create(*session.ctx, "entry_block", function);
+    session.builder->SetInsertPoint(basicBlock);
+
+    // Top-level expressions share one reserved name, so they are not profiled.
+    // Specializations count toward the definition they were cloned from.
+    StringRef name = this->prototype->getName();
+    session.profileFunction = name.startswith("__") ? StringRef() : name;
+    session.profileSite = 0;
+    beginDebugScope(function, this->prototype->getLine());
+    emitProfileCount(0, nullptr);
+    emitCallCount();
+    setProfileCalls(function);
+
+    const vector<unsigned> &argNames = this->prototype->getArgs();
+    Function::arg_iterator param = function->arg_begin();
+    for (unsigned i = 0; i < argNames.size(); i++)
+    {
+        Type *type = getType(this->prototype->getArgTypes()[i]);
+        AllocaInst *variable = createEntryBlockAlloca(function, argNames[i], type);
+        if (!boundArgs.empty() && boundArgs[i])
+            session.builder->CreateStore(boundArgs[i], variable);
+        else
+        {
+            param->setName(symbols.getName(argNames[i]));
+            session.builder->CreateStore(&*param++, variable);
+        }
+        namedValue(argNames[i]) = variable;
+    }
 
-    if (!function)
+    Value *returnValue;
     {
-        function = this->prototype->codegen();
-        if (!function)
-            return nullptr;
+        StageTimer timer(CompileStage::IRGen, name);
+        returnValue = this->body->codegen();
     }
 
-    if (!function->empty())
-        return (Function *)logErrorValue("Function can not be redefine");
+    for (unsigned argName : argNames)
+        namedValue(argName) = nullptr;
 
-    BasicBlock *basicBlock = BasicBlock::Create(*ctx, "entry_block", function);
-    builder->SetInsertPoint(basicBlock);
+    if (!returnValue)
+    {
+        endDebugScope(function, false);
+        return false;
+    }
 
-    namedValues.clear();
-    for (auto &arg : function->args())
-        namedValues[arg.getName().str()] = &arg;
+    returnValue = createConversion(returnValue, function->getReturnType());
+    markTailCalls(returnValue, session.builder->CreateRet(returnValue));
+    endDebugScope(function, true);
+    verifyFunction(*function);
+    return true;
+}
 
-    if (Value *returnValue = this->body->codegen())
+void FunctionExpressionAST::codegenSpecialization(Function *clone, ArrayRef<Constant *> boundArgs)
+{
+    if (!this->codegenBody(clone, boundArgs))
     {
-        builder->CreateRet(returnValue);
-        verifyFunction(*function);
+        // The definition compiled before, so this only fails if something it
+        // calls was forgotten since. Fall back to calling it unspecialized.
+        clone->deleteBody();
+        clone->setLinkage(Function::InternalLinkage);
+        session.builder->SetInsertPoint(BasicBlock::Create(*session.ctx, "entry_block", clone));
+        std::vector<Value *> args;
+        Function::arg_iterator param = clone->arg_begin();
+        for (Constant *boundArg : boundArgs)
+            args.push_back(boundArg ? (Value *)boundArg : &*param++);
+        FunctionCallee generic = session.module->getOrInsertFunction(this->prototype->getName(),
+                                                                     getFunctionType(*this->prototype));
+        session.builder->CreateRet(session.builder->CreateCall(generic, args, "callres"));
+        return;
+    }
 
-        return function;
+    StageTimer timer(CompileStage::Optimize, this->prototype->getName());
+    session.functionPassManager->run(*clone, *session.functionAnalysisManager);
+}
+
+Function *FunctionExpressionAST::codegen()
+{
+    Function *function = this->prototype->codegen();
+    if (!function)
+        return nullptr;
+
+    // A memo def's body goes into an internal function, so that its
+    // recursive calls resolve to the caching entry point.
+    Function *entry = function;
+    if (this->prototype->isMemoized())
+        function = Function::Create(entry->getFunctionType(), Function::InternalLinkage,
+                                    entry->getName() + ".memo.compute", session.module.get());
+
+    size_t pending = session.pendingSpecializations.size();
+    if (!this->codegenBody(function, {}))
+    {
+        // Drop the specializations only the failed body called.
+        function->eraseFromParent();
+        if (entry != function)
+            entry->eraseFromParent();
+        while (session.pendingSpecializations.size() > pending)
+        {
+            session.pendingSpecializations.back().clone->eraseFromParent();
+            session.pendingSpecializations.pop_back();
+        }
+        return nullptr;
     }
 
-    function->eraseFromParent();
-    return nullptr;
+    if (entry != function)
+        createMemoEntry(entry, function);
+
+    {
+        StageTimer timer(CompileStage::Optimize, this->prototype->getName());
+        session.functionPassManager->run(*function, *session.functionAnalysisManager);
+        if (entry != function)
+            session.functionPassManager->run(*entry, *session.functionAnalysisManager);
+    }
+
+    // Specializations may call further specializations.
+    bool specialized = session.pendingSpecializations.size() > pending;
+    while (session.pendingSpecializations.size() > pending)
+    {
+        Specialization next = std::move(session.pendingSpecializations.back());
+        session.pendingSpecializations.pop_back();
+        next.definition->codegenSpecialization(next.clone, next.boundArgs);
+    }
+
+    if (specialized && session.inlinePassManager)
+    {
+        StageTimer timer(CompileStage::Optimize, this->prototype->getName());
+        session.inlinePassManager->run(*session.module, *session.moduleAnalysisManager);
+    }
+
+    return entry;
 }
 
 Value *IfExpressionAST::codegen()
@@ -179,39 +1537,46 @@ Value *IfExpressionAST::codegen()
     if (!conditionValue)
         return nullptr;
 
-    conditionValue = builder->CreateFCmpONE(
-        conditionValue, ConstantFP::get(*ctx, APFloat(0.0)), "ifcond");
+    conditionValue = createIsTrue(conditionValue, "ifcond");
 
-    Function *function = builder->GetInsertBlock()->getParent();
-    BasicBlock *thenBasicBlock = BasicBlock::Create(*ctx, "then_stmt", function);
-    BasicBlock *elseBasicBlock = BasicBlock::Create(*ctx, "else_stmt");
-    BasicBlock *mergeBasicBlock = BasicBlock::Create(*ctx, "merge_stmt");
+    Function *function = session.builder->GetInsertBlock()->getParent();
+    BasicBlock *thenBasicBlock = BasicBlock::Create(*session.ctx, "then_stmt", function);
+    BasicBlock *elseBasicBlock = BasicBlock::Create(*session.ctx, "else_stmt");
+    BasicBlock *mergeBasicBlock = BasicBlock::Create(*session.ctx, "merge_stmt");
 
-    builder->CreateCondBr(conditionValue, thenBasicBlock, elseBasicBlock);
+    unsigned site = ++session.profileSite;
+    emitProfileCount(site, conditionValue);
+    setProfileWeights(site, session.builder->CreateCondBr(conditionValue, thenBasicBlock, elseBasicBlock));
 
-    builder->SetInsertPoint(thenBasicBlock);
+    session.builder->SetInsertPoint(thenBasicBlock);
 
     Value *thenValue = this->thenStmt->codegen();
     if (!thenValue)
         return nullptr;
-
-    builder->CreateBr(mergeBasicBlock);
-    thenBasicBlock = builder->GetInsertBlock();
+    thenBasicBlock = session.builder->GetInsertBlock();
 
     function->getBasicBlockList().push_back(elseBasicBlock);
-    builder->SetInsertPoint(elseBasicBlock);
+    session.builder->SetInsertPoint(elseBasicBlock);
 
     Value *elseValue = this->elseStmt->codegen();
     if (!elseValue)
         return nullptr;
-
-    builder->CreateBr(mergeBasicBlock);
-    elseBasicBlock = builder->GetInsertBlock();
+    elseBasicBlock = session.builder->GetInsertBlock();
+
+    // The arms branch to the merge once both types are known, converting
+    // their value to the common one on the way.
+    Type *type = getCommonType(this->thenStmt, thenValue, this->elseStmt, elseValue);
+    session.builder->SetInsertPoint(thenBasicBlock);
+    thenValue = createConversion(thenValue, type);
+    session.builder->CreateBr(mergeBasicBlock);
+    session.builder->SetInsertPoint(elseBasicBlock);
+    elseValue = createConversion(elseValue, type);
+    session.builder->CreateBr(mergeBasicBlock);
 
     function->getBasicBlockList().push_back(mergeBasicBlock);
-    builder->SetInsertPoint(mergeBasicBlock);
+    session.builder->SetInsertPoint(mergeBasicBlock);
 
-    PHINode *phiNode = builder->CreatePHI(Type::getDoubleTy(*ctx), 2, "iftmp");
+    PHINode *phiNode = session.builder->CreatePHI(type, 2, "iftmp");
 
     phiNode->addIncoming(thenValue, thenBasicBlock);
     phiNode->addIncoming(elseValue, elseBasicBlock);
@@ -221,22 +1586,21 @@ Value *IfExpressionAST::codegen()
 
 Value *ForExpressionAST::codegen()
 {
+    setDebugLine(this->line);
     Value *startValue = this->start->codegen();
     if (!startValue)
         return nullptr;
 
-    Function *function = builder->GetInsertBlock()->getParent();
-    BasicBlock *preHeaderBasicBlock = builder->GetInsertBlock();
-    BasicBlock *loopBasicBlock = BasicBlock::Create(*ctx, "loop", function);
-    builder->CreateBr(loopBasicBlock);
+    Function *function = session.builder->GetInsertBlock()->getParent();
+    AllocaInst *variable = createEntryBlockAlloca(function, this->varName, startValue->getType());
+    session.builder->CreateStore(startValue, variable);
 
-    builder->SetInsertPoint(loopBasicBlock);
+    BasicBlock *loopBasicBlock = BasicBlock::Create(*session.ctx, "loop", function);
+    session.builder->CreateBr(loopBasicBlock);
 
-    PHINode *phiVariable = builder->CreatePHI(Type::getDoubleTy(*ctx), 2, this->varName.c_str());
-    phiVariable->addIncoming(startValue, preHeaderBasicBlock);
+    session.builder->SetInsertPoint(loopBasicBlock);
 
-    Value *oldValue = namedValues[this->varName];
-    namedValues[this->varName] = phiVariable;
+    ScopedNamedValue loopVariable(this->varName, variable);
 
     if (!this->body->codegen())
         return nullptr;
@@ -250,29 +1614,32 @@ Value *ForExpressionAST::codegen()
     }
     else
     {
-        stepValue = ConstantFP::get(*ctx, APFloat(1.0));
+        stepValue = ConstantFP::get(*session.ctx, APFloat(1.0));
     }
+    Type *type = variable->getAllocatedType();
+    stepValue = createConversion(stepValue, type);
 
-    Value *nextValue = builder->CreateFAdd(phiVariable, stepValue, "nextval");
+    // The body may assign the loop variable, so step from its current value.
+    // The end condition still sees the value before the step.
+    setDebugLine(this->line);
+    Value *currentValue = session.builder->CreateLoad(variable->getAllocatedType(), variable,
+                                                      symbols.getName(this->varName));
+    Value *nextValue = type->isIntegerTy() ? session.builder->CreateAdd(currentValue, stepValue, "nextval")
+                                           : session.builder->CreateFAdd(currentValue, stepValue, "nextval");
 
     Value *endCondition = this->end->codegen();
     if (!endCondition)
         return nullptr;
+    session.builder->CreateStore(nextValue, variable);
 
-    endCondition = builder->CreateFCmpONE(endCondition, ConstantFP::get(*ctx, APFloat(0.0)), "loopcond");
-    BasicBlock *loopEndBasicBlock = builder->GetInsertBlock();
-    BasicBlock *afterloopBasicBlock = BasicBlock::Create(*ctx, "afterloop", function);
-
-    builder->CreateCondBr(endCondition, loopBasicBlock, afterloopBasicBlock);
+    endCondition = createIsTrue(endCondition, "loopcond");
+    BasicBlock *afterloopBasicBlock = BasicBlock::Create(*session.ctx, "afterloop", function);
 
-    builder->SetInsertPoint(afterloopBasicBlock);
+    unsigned site = ++session.profileSite;
+    emitProfileCount(site, endCondition);
+    setProfileWeights(site, session.builder->CreateCondBr(endCondition, loopBasicBlock, afterloopBasicBlock));
 
-    phiVariable->addIncoming(nextValue, loopEndBasicBlock);
-
-    if (oldValue)
-        namedValues[this->varName] = oldValue;
-    else
-        namedValues.erase(this->varName);
+    session.builder->SetInsertPoint(afterloopBasicBlock);
 
-    return Constant::getNullValue(Type::getDoubleTy(*ctx));
+    return Constant::getNullValue(Type::getDoubleTy(*session.ctx));
 }
\ No newline at end of file
@@ -1,4 +1,8 @@
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
 #include "llvm/IR/Value.h"
+#include "llvm/Support/Allocator.h"
 #include <algorithm>
 #include <cassert>
 #include <cctype>
@@ -7,19 +11,106 @@
 #include <cstdlib>
 #include <string>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 using namespace std;
 using namespace llvm;
 
+class PrototypeAST;
+class FunctionExpressionAST;
+struct TieredFunction;
+
+namespace llvm
+{
+    class Constant;
+    class TargetMachine;
+}
+
+// Interns identifiers so the AST and the codegen scopes refer to names by a
+// dense integer ID. Names are never removed, so IDs and the returned
+// StringRefs stay valid for the whole process.
+class SymbolTable
+{
+    StringMap<unsigned> ids;
+    vector<StringRef> names;
+    mutable std::mutex mutex;
+
+public:
+    unsigned intern(StringRef name);
+    // Returns -1 if name was never interned.
+    int find(StringRef name) const;
+    StringRef getName(unsigned id) const;
+    unsigned size() const;
+};
+
+extern SymbolTable symbols;
+
+// The type of a value. Parameters, results and locals are f64 unless
+// annotated, as in def f(a:f32 b:f32):f32; see BinaryExpAST::codegen for how
+// types combine. Each type is named by its code in function signatures, as
+// in the Band.h CompiledFunction.
+enum class ValueType : char
+{
+    F64 = 'd',
+    F32 = 'f',
+    I64 = 'l'
+};
+
+// The type called name, e.g. f32, which is also its conversion function.
+bool findValueType(StringRef name, ValueType &type);
+StringRef getValueTypeName(ValueType type);
+// The conversion a call of name is, such as f32(x); false for other names.
+bool getConversionType(unsigned name, ValueType &type);
+// Converts like generated code does: f32 rounds to nearest, i64 truncates
+// toward zero and saturates, with NaN converted to 0.
+int64_t toInt64(double value);
+double convertValue(ValueType type, double value);
+
 void initialModulesAndPassManager();
+void optimizeModule(TargetMachine *targetMachine);
 void initializeNativeTargets();
+// Definitions pass their AST, so calls with constant arguments can be
+// generated against a specialized clone of the body.
+bool declareFunction(const PrototypeAST &prototype, shared_ptr<FunctionExpressionAST> definition = nullptr);
+void forgetFunction(unsigned name);
+int getFunctionArity(unsigned name);
+// The type codes of the result and the parameters of definition or extern
+// name, e.g. "fff" for def f(a:f32 b:f32):f32, or "" if it is unknown.
+std::string getFunctionSignature(unsigned name);
+// The arity of the math builtin called name, e.g. 1 for sqrt, or -1.
+int getBuiltinArity(unsigned name);
+// Whether prototype names a math builtin, a function in the runtime table,
+// or a C library function LLVM recognizes with its signature. The optimizer
+// folds and rewrites calls to those as the library's, and the libcalls it
+// emits resolve by name, so a definition must not reuse one.
+bool isLibraryFunction(const PrototypeAST &prototype);
+// Computes a call of a math builtin that no definition shadows.
+bool evaluateBuiltin(unsigned name, ArrayRef<double> args, double &result);
+Function *getFunction(unsigned name);
+Function *createArrayEntry(Function *function);
+Function *createMapEntry(Function *function);
+void createMemoEntry(Function *function, Function *compute);
+
+// Expression nodes are allocated from the arena of the function they belong
+// to and are freed with it, so they only hold trivially destructible
+// members. Most function bodies fit in a single small slab. Calls, binary
+// operators and loops keep their source line for debug info in padding
+// they already had; other nodes take the line of their parent.
+typedef BumpPtrAllocatorImpl<MallocAllocator, 1024> ASTArena;
 
 class ExpressionAST
 {
 public:
     virtual ~ExpressionAST() {}
     virtual Value *codegen() = 0;
+    virtual double eval() = 0;
+    // The name a bare variable reference can be assigned to, or -1.
+    virtual int getVariableName() const { return -1; }
+    // Folds the constant subexpressions of this node, which may replace the
+    // node itself with a number allocated from arena; see Fold.cpp.
+    virtual ExpressionAST *fold(ASTArena &arena) { return this; }
+    virtual bool getConstant(double &value) const { return false; }
 };
 
 class NumberExpAST : public ExpressionAST
@@ -29,83 +120,173 @@ class NumberExpAST : public ExpressionAST
 public:
     NumberExpAST(double val) : value(val) {}
     Value *codegen() override;
+    double eval() override;
+    bool getConstant(double &value) const override
+    {
+        value = this->value;
+        return true;
+    }
 };
 
 class VariableExpAST : public ExpressionAST
 {
-    string name;
+    unsigned name;
 
 public:
-    VariableExpAST(string name) : name(name) {}
+    VariableExpAST(unsigned name) : name(name) {}
     Value *codegen() override;
+    double eval() override;
+    int getVariableName() const override { return this->name; }
+};
+
+class AssignExpAST : public ExpressionAST
+{
+    unsigned name;
+    unsigned line;
+    ExpressionAST *value;
+
+public:
+    AssignExpAST(unsigned name, ExpressionAST *value, unsigned line = 0) : name(name), line(line), value(value) {}
+    Value *codegen() override;
+    double eval() override;
+    ExpressionAST *fold(ASTArena &arena) override;
+};
+
+// var a = 1, b in body: binds mutable locals (b starts at 0) for body.
+class VarExpressionAST : public ExpressionAST
+{
+    MutableArrayRef<pair<unsigned, ExpressionAST *>> vars;
+    ExpressionAST *body;
+
+public:
+    VarExpressionAST(MutableArrayRef<pair<unsigned, ExpressionAST *>> vars, ExpressionAST *body)
+        : vars(vars), body(body) {}
+    Value *codegen() override;
+    double eval() override;
+    ExpressionAST *fold(ASTArena &arena) override;
 };
 
 class BinaryExpAST : public ExpressionAST
 {
     char op;
-    unique_ptr<ExpressionAST> lhs, rhs;
+    unsigned line;
+    ExpressionAST *lhs, *rhs;
 
 public:
-    BinaryExpAST(char op, unique_ptr<ExpressionAST> lhs,
-                 unique_ptr<ExpressionAST> rhs) : op(op), lhs(move(lhs)), rhs(move(rhs)) {}
+    BinaryExpAST(char op, ExpressionAST *lhs, ExpressionAST *rhs, unsigned line = 0)
+        : op(op), line(line), lhs(lhs), rhs(rhs) {}
     Value *codegen() override;
+    double eval() override;
+    ExpressionAST *fold(ASTArena &arena) override;
 };
 
 class CallExpressionAST : public ExpressionAST
 {
-    string funcName;
-    vector<unique_ptr<ExpressionAST>> args;
+    unsigned funcName;
+    unsigned line;
+    MutableArrayRef<ExpressionAST *> args;
+    TieredFunction *callee = nullptr;
+    uint64_t externAddress = 0;
 
 public:
-    CallExpressionAST(string funcName, vector<unique_ptr<ExpressionAST>> args) : funcName(funcName),
-                                                                                 args(move(args)) {}
+    CallExpressionAST(unsigned funcName, MutableArrayRef<ExpressionAST *> args, unsigned line = 0)
+        : funcName(funcName), line(line), args(args) {}
     Value *codegen() override;
+    double eval() override;
+    ExpressionAST *fold(ASTArena &arena) override;
 };
 
 class IfExpressionAST : public ExpressionAST
 {
-    unique_ptr<ExpressionAST> cond, thenStmt, elseStmt;
+    ExpressionAST *cond, *thenStmt, *elseStmt;
 
 public:
-    IfExpressionAST(unique_ptr<ExpressionAST> cond, unique_ptr<ExpressionAST> thenStmt,
-                    unique_ptr<ExpressionAST> elseStmt)
-        : cond(move(cond)), thenStmt(move(thenStmt)), elseStmt(move(elseStmt)) {}
+    IfExpressionAST(ExpressionAST *cond, ExpressionAST *thenStmt, ExpressionAST *elseStmt)
+        : cond(cond), thenStmt(thenStmt), elseStmt(elseStmt) {}
 
     Value *codegen() override;
+    double eval() override;
+    ExpressionAST *fold(ASTArena &arena) override;
 };
 
 class ForExpressionAST : public ExpressionAST
 {
-    string varName;
-    unique_ptr<ExpressionAST> start, end, step, body;
+    unsigned varName;
+    unsigned line;
+    ExpressionAST *start, *end, *step, *body;
 
 public:
-    ForExpressionAST(string &varName, unique_ptr<ExpressionAST> start, unique_ptr<ExpressionAST> end,
-                     unique_ptr<ExpressionAST> step, unique_ptr<ExpressionAST> body)
-        : varName(varName), start(move(start)), end(move(end)), step(move(step)), body(move(body)) {}
+    ForExpressionAST(unsigned varName, ExpressionAST *start, ExpressionAST *end,
+                     ExpressionAST *step, ExpressionAST *body, unsigned line = 0)
+        : varName(varName), line(line), start(start), end(end), step(step), body(body) {}
 
     Value *codegen() override;
+    double eval() override;
+    ExpressionAST *fold(ASTArena &arena) override;
 };
 
 class PrototypeAST
 {
-    string name;
-    vector<string> args;
+    unsigned name;
+    unsigned line = 0;
+    vector<unsigned> args;
+    vector<ValueType> argTypes;
+    ValueType returnType = ValueType::F64;
+    bool memoized = false;
+    bool external = false;
 
 public:
-    PrototypeAST(string funcName, vector<string> args) : name(funcName),
-                                                         args(move(args)) {}
+    // Arguments without a type in argTypes are f64.
+    PrototypeAST(unsigned funcName, vector<unsigned> args, vector<ValueType> argTypes = {})
+        : name(funcName), args(move(args)), argTypes(move(argTypes))
+    {
+        this->argTypes.resize(this->args.size(), ValueType::F64);
+    }
     Function *codegen();
-    string getName() { return this->name; }
+    StringRef getName() const { return symbols.getName(this->name); }
+    unsigned getNameId() const { return this->name; }
+    const vector<unsigned> &getArgs() const { return this->args; }
+    const vector<ValueType> &getArgTypes() const { return this->argTypes; }
+    ValueType getReturnType() const { return this->returnType; }
+    void setReturnType(ValueType type) { this->returnType = type; }
+    // Whether an argument or the result is not f64.
+    bool isTyped() const
+    {
+        return this->returnType != ValueType::F64 ||
+               std::any_of(this->argTypes.begin(), this->argTypes.end(),
+                           [](ValueType type)
+                           { return type != ValueType::F64; });
+    }
+    // The source line of the name, for debug info; 0 if unknown.
+    unsigned getLine() const { return this->line; }
+    void setLine(unsigned line) { this->line = line; }
+    // A memo def caches its results by argument bits; see createMemoEntry.
+    bool isMemoized() const { return this->memoized; }
+    void setMemoized(bool memoized) { this->memoized = memoized; }
+    // An extern names a math builtin or a function in the runtime table.
+    bool isExtern() const { return this->external; }
+    void setExtern(bool external) { this->external = external; }
 };
 
 class FunctionExpressionAST
 {
+    unique_ptr<ASTArena> arena;
     unique_ptr<PrototypeAST> prototype;
-    unique_ptr<ExpressionAST> body;
+    ExpressionAST *body;
+
+    bool codegenBody(Function *function, ArrayRef<Constant *> boundArgs);
 
 public:
-    FunctionExpressionAST(unique_ptr<PrototypeAST> prototype,
-                          unique_ptr<ExpressionAST> body) : prototype(move(prototype)), body(move(body)) {}
+    FunctionExpressionAST(unique_ptr<ASTArena> arena, unique_ptr<PrototypeAST> prototype,
+                          ExpressionAST *body) : arena(move(arena)), prototype(move(prototype)), body(body) {}
     Function *codegen();
-};
\ No newline at end of file
+    // Generates the body into clone, a function taking only the arguments
+    // that have no constant in boundArgs.
+    void codegenSpecialization(Function *clone, ArrayRef<Constant *> boundArgs);
+    double eval(const vector<double> &argValues);
+    // Folds constants in the body; see Fold.cpp. A definition is folded by
+    // declareFunction once it is registered, so a call to its own name is
+    // never evaluated as the builtin of that name.
+    void fold();
+    const PrototypeAST &getPrototype() const { return *this->prototype; }
+};
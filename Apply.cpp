@@ -0,0 +1,441 @@
+#include "Apply.h"
+#include "Parser.h"
+#include "Lexer.h"
+#include "Common.h"
+#include "Compiler.h"
+#include "BoundedQueue.h"
+#include "Parallel.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <sys/mman.h>
+#include <thread>
+
+typedef orc::HadiJIT::ColumnMapFunction ColumnMapFunction;
+
+// How the rows are evaluated, and what the results are reduced to.
+struct Evaluation
+{
+    ColumnMapFunction map;
+    ParallelRunner &runner;
+    uint64_t chunkRows;
+    band::Reduction reduction;
+    double result;
+};
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static bool isCSV(StringRef path)
+{
+    return path.endswith_insensitive(".csv");
+}
+
+// Compiles source and returns the column map of its last definition, with
+// the names of that definition's parameters.
+static bool compileApplied(StringRef source, std::string &name, std::vector<std::string> &params,
+                           ColumnMapFunction &map)
+{
+    lexer = std::make_unique<Lexer>(MemoryBuffer::getMemBufferCopy(source, "<apply>"));
+    std::vector<unsigned> names;
+    bool compiled = compileDefinitions(names);
+    lexer.reset();
+    if (!compiled)
+        return false;
+    if (names.empty())
+    {
+        fprintf(stderr, "--apply needs a definition to evaluate\n");
+        return false;
+    }
+
+    name = symbols.getName(names.back()).str();
+    for (auto &arg : getCurrentModule().getFunction(name)->args())
+        params.push_back(arg.getName().str());
+    if (params.empty())
+    {
+        fprintf(stderr, "%s takes no arguments, so there is nothing to apply it to\n", name.c_str());
+        return false;
+    }
+
+    exitOnError(myJIT->addModule(takeCurrentModule()));
+    initialModulesAndPassManager();
+    auto columnMap = myJIT->lookupColumnMap(name);
+    if (!columnMap)
+    {
+        logAllUnhandledErrors(columnMap.takeError(), errs(), "Error: ");
+        return false;
+    }
+    map = *columnMap;
+    return true;
+}
+
+// Finds the input column of every parameter.
+static bool bindColumns(ArrayRef<std::string> params, ArrayRef<std::string> columns, std::vector<unsigned> &bound)
+{
+    for (const std::string &param : params)
+    {
+        auto column = std::find(columns.begin(), columns.end(), param);
+        if (column == columns.end())
+        {
+            fprintf(stderr, "The input has no column named %s\n", param.c_str());
+            return false;
+        }
+        bound.push_back(column - columns.begin());
+    }
+    return true;
+}
+
+static std::vector<std::string> splitColumns(StringRef list)
+{
+    SmallVector<StringRef, 8> fields;
+    list.split(fields, ',');
+    std::vector<std::string> columns;
+    for (StringRef field : fields)
+        columns.push_back(field.trim().str());
+    return columns;
+}
+
+// Asks the kernel to start reading pages of a mapped file in the
+// background, so they are resident by the time they are used.
+static void prefetch(const double *data, uint64_t count)
+{
+    uintptr_t pageMask = sys::Process::getPageSizeEstimate() - 1;
+    uintptr_t begin = reinterpret_cast<uintptr_t>(data) & ~pageMask;
+    uintptr_t end = reinterpret_cast<uintptr_t>(data + count);
+    posix_madvise(reinterpret_cast<void *>(begin), end - begin, POSIX_MADV_WILLNEED);
+}
+
+// Drops pages of a mapped input that were used, so the resident set stays
+// at a few chunks however large the file is.
+static void release(const double *data, uint64_t count)
+{
+    uintptr_t pageMask = sys::Process::getPageSizeEstimate() - 1;
+    uintptr_t begin = (reinterpret_cast<uintptr_t>(data) + pageMask) & ~pageMask;
+    uintptr_t end = reinterpret_cast<uintptr_t>(data + count) & ~pageMask;
+    if (begin < end)
+        posix_madvise(reinterpret_cast<void *>(begin), end - begin, POSIX_MADV_DONTNEED);
+}
+
+// Where results go. A binary output of known size is mapped and the column
+// map writes straight into it; otherwise each chunk is written out from a
+// buffer, as doubles or as CSV text.
+class ResultWriter
+{
+    std::unique_ptr<raw_fd_ostream> stream;
+    std::unique_ptr<sys::fs::mapped_file_region> mapping;
+    std::vector<double> buffer;
+    bool text = false;
+
+public:
+    bool open(StringRef path, StringRef name, uint64_t knownRows, uint64_t chunkRows)
+    {
+        std::error_code error;
+        this->text = isCSV(path);
+        if (!this->text && knownRows > 0)
+        {
+            int fd;
+            error = sys::fs::openFileForReadWrite(path, fd, sys::fs::CD_CreateAlways, sys::fs::OF_None);
+            if (!error)
+                error = sys::fs::resize_file(fd, knownRows * sizeof(double));
+            if (!error)
+                this->mapping = std::make_unique<sys::fs::mapped_file_region>(
+                    sys::fs::convertFDToNativeFile(fd), sys::fs::mapped_file_region::readwrite,
+                    knownRows * sizeof(double), 0, error);
+            sys::Process::SafelyCloseFileDescriptor(fd);
+        }
+        else
+        {
+            this->stream = std::make_unique<raw_fd_ostream>(path, error, this->text ? sys::fs::OF_Text : sys::fs::OF_None);
+            this->buffer.resize(chunkRows);
+            if (this->text)
+                *this->stream << name << "\n";
+        }
+
+        if (error)
+        {
+            fprintf(stderr, "Could not open %s: %s\n", path.str().c_str(), error.message().c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // The memory the column map writes the chunk starting at row first to.
+    // Null when nothing was opened.
+    double *getOutput(uint64_t first)
+    {
+        if (!this->mapping && !this->stream)
+            return nullptr;
+        return this->mapping ? reinterpret_cast<double *>(this->mapping->data()) + first : this->buffer.data();
+    }
+
+    void write(const double *results, uint64_t rows)
+    {
+        if (!this->stream)
+            return;
+        if (!this->text)
+        {
+            this->stream->write(reinterpret_cast<const char *>(results), rows * sizeof(double));
+            return;
+        }
+        for (uint64_t row = 0; row < rows; row++)
+            *this->stream << format("%.17g\n", results[row]);
+    }
+};
+
+// Binary input is mapped as a whole. The column map reads it in place, a
+// window of a few chunks per thread at a time, while the kernel reads the
+// next window ahead.
+static bool applyBinary(Evaluation &evaluation, ArrayRef<std::string> params, ArrayRef<std::string> columns,
+                        StringRef inputPath, StringRef outputPath, StringRef name, uint64_t &rows)
+{
+    std::vector<unsigned> bound;
+    if (!bindColumns(params, columns, bound))
+        return false;
+
+    int fd;
+    uint64_t size = 0;
+    std::error_code error = sys::fs::openFileForRead(inputPath, fd);
+    if (!error)
+    {
+        error = sys::fs::file_size(inputPath, size);
+        if (error)
+            sys::Process::SafelyCloseFileDescriptor(fd);
+    }
+    if (error)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", inputPath.str().c_str(), error.message().c_str());
+        return false;
+    }
+    if (size % (columns.size() * sizeof(double)))
+    {
+        sys::Process::SafelyCloseFileDescriptor(fd);
+        fprintf(stderr, "%s does not hold %zu whole columns of doubles\n", inputPath.str().c_str(), columns.size());
+        return false;
+    }
+    rows = size / (columns.size() * sizeof(double));
+
+    std::unique_ptr<sys::fs::mapped_file_region> input;
+    if (rows > 0)
+        input = std::make_unique<sys::fs::mapped_file_region>(sys::fs::convertFDToNativeFile(fd),
+                                                              sys::fs::mapped_file_region::readonly, size, 0, error);
+    sys::Process::SafelyCloseFileDescriptor(fd);
+    if (error)
+    {
+        fprintf(stderr, "Could not map %s: %s\n", inputPath.str().c_str(), error.message().c_str());
+        return false;
+    }
+
+    ResultWriter writer;
+    uint64_t windowRows = evaluation.chunkRows * evaluation.runner.getThreadCount() * 4;
+    if (evaluation.reduction == band::Reduction::None && !writer.open(outputPath, name, rows, windowRows))
+        return false;
+    if (rows == 0)
+        return true;
+
+    const double *data = reinterpret_cast<const double *>(input->const_data());
+    posix_madvise(const_cast<char *>(input->const_data()), size, POSIX_MADV_SEQUENTIAL);
+    std::vector<const double *> chunkColumns(params.size());
+    for (unsigned column : bound)
+        prefetch(data + column * rows, std::min(windowRows, rows));
+
+    for (uint64_t first = 0; first < rows; first += windowRows)
+    {
+        uint64_t count = std::min(windowRows, rows - first);
+        uint64_t next = first + count;
+        for (unsigned column : bound)
+            if (next < rows)
+                prefetch(data + column * rows + next, std::min(windowRows, rows - next));
+
+        for (unsigned i = 0; i < bound.size(); i++)
+            chunkColumns[i] = data + bound[i] * rows + first;
+        double *results = writer.getOutput(first);
+        mapRows(evaluation.runner, evaluation.map, chunkColumns, results, count, evaluation.chunkRows,
+                evaluation.reduction, evaluation.result);
+        writer.write(results, count);
+
+        for (unsigned column : bound)
+            release(data + column * rows + first, count);
+    }
+    return true;
+}
+
+// Rows of a CSV file parsed into one array per parameter.
+struct ColumnChunk
+{
+    std::vector<std::vector<double>> columns;
+    std::vector<const double *> pointers;
+    uint64_t rows = 0;
+};
+
+typedef BoundedQueue<ColumnChunk *> ChunkQueue;
+
+// Parses the CSV text into chunks on its own thread. Two chunks circulate
+// between it and the evaluating thread, so parsing the next chunk overlaps
+// evaluating the current one.
+static void parseCSV(const MemoryBuffer &input, const char *current, uint64_t line, ArrayRef<int> paramOfColumn,
+                     ChunkQueue &empty, ChunkQueue &filled, uint64_t chunkRows, bool &failed)
+{
+    const char *end = input.getBufferEnd();
+    ColumnChunk *chunk = nullptr;
+    while (current < end && !failed)
+    {
+        if (!chunk)
+        {
+            empty.pop(chunk);
+            chunk->rows = 0;
+        }
+
+        line++;
+        if (*current == '\n' || *current == '\r')
+        {
+            current++;
+            continue;
+        }
+        for (unsigned column = 0; column < paramOfColumn.size(); column++)
+        {
+            char *fieldEnd;
+            double value = strtod(current, &fieldEnd);
+            bool last = column + 1 == paramOfColumn.size();
+            char separator = fieldEnd < end ? *fieldEnd : '\n';
+            if (fieldEnd == current || (last ? separator != '\n' && separator != '\r' : separator != ','))
+            {
+                fprintf(stderr, "Line %llu: expected %zu numbers separated by commas\n", (unsigned long long)line,
+                        paramOfColumn.size());
+                failed = true;
+                break;
+            }
+            if (paramOfColumn[column] >= 0)
+                chunk->columns[paramOfColumn[column]][chunk->rows] = value;
+            current = fieldEnd + 1;
+        }
+        if (current < end && current[-1] == '\r' && *current == '\n')
+            current++;
+
+        if (!failed && ++chunk->rows == chunkRows)
+        {
+            filled.push(chunk);
+            chunk = nullptr;
+        }
+    }
+    if (chunk && chunk->rows && !failed)
+        filled.push(chunk);
+    filled.close();
+}
+
+static bool applyCSV(Evaluation &evaluation, ArrayRef<std::string> params, std::vector<std::string> columns,
+                     StringRef inputPath, StringRef outputPath, StringRef name, uint64_t &rows)
+{
+    uint64_t chunkRows = evaluation.chunkRows;
+    auto input = MemoryBuffer::getFile(inputPath);
+    if (!input)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", inputPath.str().c_str(), input.getError().message().c_str());
+        return false;
+    }
+
+    // Without --columns, the first line names them.
+    const char *current = (*input)->getBufferStart();
+    uint64_t line = 0;
+    if (columns.empty())
+    {
+        line = 1;
+        StringRef text = (*input)->getBuffer();
+        StringRef header = text.take_until([](char c)
+                                           { return c == '\n' || c == '\r'; });
+        columns = splitColumns(header);
+        current += header.size();
+        while (current < (*input)->getBufferEnd() && (*current == '\n' || *current == '\r'))
+            current++;
+    }
+
+    std::vector<unsigned> bound;
+    if (!bindColumns(params, columns, bound))
+        return false;
+    std::vector<int> paramOfColumn(columns.size(), -1);
+    for (unsigned i = 0; i < bound.size(); i++)
+        paramOfColumn[bound[i]] = i;
+
+    ResultWriter writer;
+    if (evaluation.reduction == band::Reduction::None && !writer.open(outputPath, name, 0, chunkRows))
+        return false;
+
+    ColumnChunk chunks[2];
+    ChunkQueue empty(2, 1), filled(1, 1);
+    for (ColumnChunk &chunk : chunks)
+    {
+        chunk.columns.assign(params.size(), std::vector<double>(chunkRows));
+        for (auto &column : chunk.columns)
+            chunk.pointers.push_back(column.data());
+        empty.push(&chunk);
+    }
+
+    bool failed = false;
+    std::thread parser(parseCSV, std::cref(**input), current, line, ArrayRef<int>(paramOfColumn), std::ref(empty),
+                       std::ref(filled), chunkRows, std::ref(failed));
+    ColumnChunk *chunk;
+    while (filled.pop(chunk))
+    {
+        double *results = writer.getOutput(rows);
+        // Parsing is far slower than evaluating, so a chunk is not split.
+        mapRows(evaluation.runner, evaluation.map, chunk->pointers, results, chunk->rows, chunkRows,
+                evaluation.reduction, evaluation.result);
+        writer.write(results, chunk->rows);
+        rows += chunk->rows;
+        empty.push(chunk);
+    }
+    parser.join();
+    return !failed;
+}
+
+static const char *getReductionName(band::Reduction reduction)
+{
+    switch (reduction)
+    {
+    case band::Reduction::Sum:
+        return "Sum";
+    case band::Reduction::Min:
+        return "Minimum";
+    default:
+        return "Maximum";
+    }
+}
+
+int runApply(StringRef source, StringRef inputPath, StringRef columnList, StringRef outputPath, uint64_t chunkRows,
+             unsigned threads, band::Reduction reduction)
+{
+    std::string name;
+    std::vector<std::string> params;
+    ColumnMapFunction map;
+    if (!compileApplied(source, name, params, map))
+        return 1;
+
+    // Binary columns can not name themselves.
+    std::vector<std::string> columns = columnList.empty() ? std::vector<std::string>() : splitColumns(columnList);
+    if (columns.empty() && !isCSV(inputPath))
+        columns = params;
+
+    ParallelRunner runner(threads);
+    Evaluation evaluation{map, runner, chunkRows, reduction, getReductionIdentity(reduction)};
+    auto start = std::chrono::steady_clock::now();
+    uint64_t rows = 0;
+    bool applied = isCSV(inputPath)
+                       ? applyCSV(evaluation, params, columns, inputPath, outputPath, name, rows)
+                       : applyBinary(evaluation, params, columns, inputPath, outputPath, name, rows);
+    if (!applied)
+        return 1;
+
+    double seconds = secondsSince(start);
+    fprintf(stderr, "Applied %s to %llu rows in %.3f s on %u threads: %.1f Mrows/s\n", name.c_str(),
+            (unsigned long long)rows, seconds, runner.getThreadCount(), rows / seconds / 1e6);
+    if (reduction != band::Reduction::None)
+        fprintf(stderr, "%s of %s: %.17g\n", getReductionName(reduction), name.c_str(), evaluation.result);
+    return 0;
+}
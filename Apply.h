@@ -0,0 +1,16 @@
+#include "Band.h"
+#include "llvm/ADT/StringRef.h"
+#include <cstdint>
+
+// Compiles the definitions in source and evaluates the last one over every
+// row of inputPath, writing one double per row to outputPath. A file ending
+// in .csv holds text with a header row; any other file is binary and holds
+// each column as a block of native doubles, one column after the other.
+// columnList, e.g. "a,b", names the input's columns in order; CSV files
+// then have no header. Parameters take the column of the same name.
+// Rows are evaluated chunkRows at a time through the definition's column
+// map, on threads threads. With a reduction, only the sum, minimum or
+// maximum of the results is printed and outputPath is not written.
+// Reports rows per second.
+int runApply(llvm::StringRef source, llvm::StringRef inputPath, llvm::StringRef columnList,
+             llvm::StringRef outputPath, uint64_t chunkRows, unsigned threads, band::Reduction reduction);
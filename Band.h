@@ -0,0 +1,200 @@
+#ifndef BAND_H
+#define BAND_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+
+class ParallelRunner;
+
+namespace band
+{
+    template <typename... ArgsT>
+    struct AllDoubles : std::true_type
+    {
+    };
+
+    template <typename FirstT, typename... RestT>
+    struct AllDoubles<FirstT, RestT...>
+        : std::integral_constant<bool, std::is_same<FirstT, double>::value && AllDoubles<RestT...>::value>
+    {
+    };
+
+    // The C++ types of Band's f64, f32 and i64, by the code that names them
+    // in a signature.
+    template <typename T>
+    struct TypeCode;
+
+    template <>
+    struct TypeCode<double> : std::integral_constant<char, 'd'>
+    {
+    };
+
+    template <>
+    struct TypeCode<float> : std::integral_constant<char, 'f'>
+    {
+    };
+
+    template <>
+    struct TypeCode<int64_t> : std::integral_constant<char, 'l'>
+    {
+    };
+
+    // A typed pointer to a JIT-compiled definition. Calling it is a direct
+    // function-pointer call; it stays valid until its module is unloaded.
+    // The signature must match the definition's, e.g. float(float, float)
+    // for def f(a:f32 b:f32):f32.
+    template <typename Signature>
+    class CompiledFunction;
+
+    template <typename ResultT, typename... ArgsT>
+    class CompiledFunction<ResultT(ArgsT...)>
+    {
+        ResultT (*pointer)(ArgsT...) = nullptr;
+
+    public:
+        static constexpr int arity = sizeof...(ArgsT);
+
+        // The type codes of the result and the arguments, e.g. "fff".
+        static std::string signature() { return {TypeCode<ResultT>::value, TypeCode<ArgsT>::value...}; }
+
+        CompiledFunction() {}
+        explicit CompiledFunction(ResultT (*pointer)(ArgsT...)) : pointer(pointer) {}
+
+        ResultT operator()(ArgsT... args) const { return this->pointer(args...); }
+        explicit operator bool() const { return this->pointer != nullptr; }
+    };
+
+    // Evaluates a definition over rows; see HadiJIT::lookupColumnMap.
+    using ColumnMapFunction = void (*)(const double *const *columns, double *out, uint64_t rows);
+
+    // What Engine::evaluateParallel combines the results of a definition into.
+    enum class Reduction
+    {
+        None,
+        Sum,
+        Min,
+        Max
+    };
+
+    // How often a memo def found its arguments in its cache.
+    struct MemoStats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+    };
+
+    class ModuleHandle
+    {
+        unsigned id = 0;
+        friend class Engine;
+
+    public:
+        ModuleHandle() {}
+        explicit ModuleHandle(unsigned id) : id(id) {}
+        explicit operator bool() const { return this->id != 0; }
+    };
+
+    // Embeds the Band compiler and JIT in a host program. Only one Engine may
+    // exist at a time, but any number of threads may compile into it, look
+    // up functions and call them concurrently. Each thread parses and
+    // generates IR on its own; the compiled code lands in one shared JIT.
+    class Engine
+    {
+        struct LoadedModule;
+
+        std::mutex mutex;
+        std::map<unsigned, std::unique_ptr<LoadedModule>> modules;
+        unsigned nextModuleId = 1;
+        struct CachedFunction
+        {
+            uint64_t address;
+            std::string signature;
+        };
+        llvm::StringMap<CachedFunction> functions;
+        std::unique_ptr<ParallelRunner> runner;
+        unsigned parallelThreads = 0;
+
+        Engine();
+        ParallelRunner &getRunner();
+        // An empty signature matches any definition.
+        llvm::Expected<uint64_t> lookup(llvm::StringRef name, llvm::StringRef signature);
+        llvm::Error addSymbol(llvm::StringRef name, uint64_t address);
+
+    public:
+        ~Engine();
+
+        // With memoStats, memo defs count their cache hits and misses for
+        // getMemoStats. Every call then updates a counter shared by all
+        // threads, so leave it off where memo defs are called concurrently.
+        static llvm::Expected<std::unique_ptr<Engine>> create(unsigned optimizationLevel = 2, bool memoStats = false);
+
+        // Compiles every definition in source into one module. Top-level
+        // expressions are rejected. Later modules may call these definitions.
+        llvm::Expected<ModuleHandle> compile(llvm::StringRef source);
+
+        // Removes a module's code from the JIT and forgets its definitions.
+        // Functions obtained from it, and modules calling into it, must not be
+        // called afterwards.
+        llvm::Error unload(ModuleHandle module);
+
+        // Looks up a definition by name. The address is cached, so repeated
+        // lookups are cheap, but hot paths should keep the returned function.
+        template <typename Signature>
+        llvm::Expected<CompiledFunction<Signature>> getFunction(llvm::StringRef name);
+
+        llvm::Expected<ColumnMapFunction> getColumnMap(llvm::StringRef name);
+
+        // Evaluates a definition's column map over rows on every core. The rows
+        // are split into chunks that idle threads steal from busy ones. Results
+        // go to out unless it is null; the chunk results are then combined
+        // in row order into the returned sum, minimum or maximum (0 without
+        // a reduction), so the result does not depend on the thread count.
+        llvm::Expected<double> evaluateParallel(llvm::StringRef name, const double *const *columns, double *out,
+                                                uint64_t rows, Reduction reduction = Reduction::None);
+
+        // How many threads evaluateParallel uses, the calling one included;
+        // 0, the default, uses every core. Not while evaluateParallel runs.
+        void setParallelThreads(unsigned threads);
+
+        // Allocates an out array for evaluateParallel. Each page is first
+        // touched by the thread that will write it, which places it on that
+        // thread's NUMA node. Free it with freeRows.
+        double *allocateRows(uint64_t rows);
+        void freeRows(double *rows, uint64_t count);
+
+        // Reads the cache counters of a memo def; needs an Engine created with memoStats.
+        llvm::Expected<MemoStats> getMemoStats(llvm::StringRef name);
+
+        // Makes a host function callable from Band source that declares it,
+        // e.g. `extern clamp(x lo hi);`. Add it before compiling callers.
+        template <typename... ArgsT>
+        llvm::Error addFunction(llvm::StringRef name, double (*function)(ArgsT...));
+    };
+
+    template <typename Signature>
+    llvm::Expected<CompiledFunction<Signature>> Engine::getFunction(llvm::StringRef name)
+    {
+        using Pointer = typename std::add_pointer<Signature>::type;
+
+        auto address = this->lookup(name, CompiledFunction<Signature>::signature());
+        if (!address)
+            return address.takeError();
+        return CompiledFunction<Signature>(reinterpret_cast<Pointer>(static_cast<uintptr_t>(*address)));
+    }
+
+    template <typename... ArgsT>
+    llvm::Error Engine::addFunction(llvm::StringRef name, double (*function)(ArgsT...))
+    {
+        static_assert(AllDoubles<ArgsT...>::value, "Band functions only take doubles");
+        return this->addSymbol(name, reinterpret_cast<uintptr_t>(function));
+    }
+} // namespace band
+
+#endif
@@ -0,0 +1,189 @@
+#include "Batch.h"
+#include "Parser.h"
+#include "Lexer.h"
+#include "Common.h"
+#include "BoundedQueue.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <map>
+#include <thread>
+
+// A definition or top-level expression on its way through the pipeline.
+struct BatchItem
+{
+    uint64_t sequence = 0;
+    shared_ptr<FunctionExpressionAST> function;
+    bool topLevel = false;
+    orc::ThreadSafeModule module;
+};
+
+typedef BoundedQueue<unique_ptr<BatchItem>> BatchQueue;
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Parses the whole file in order. Prototypes are declared here, so the
+// code generation workers can take definitions in any order.
+static void parseStage(StringRef path, BatchQueue &parsed, double &seconds)
+{
+    auto start = std::chrono::steady_clock::now();
+    lexer = Lexer::createForFile(path);
+    uint64_t sequence = 0;
+    if (lexer)
+        getNextToken();
+    while (lexer && curToken != tok_eof)
+    {
+        auto item = make_unique<BatchItem>();
+        switch (curToken)
+        {
+        case ';':
+            getNextToken();
+            continue;
+        case tok_extern:
+            if (auto prototype = parseExtern())
+            {
+                if (!declareFunction(*prototype))
+                    logError("Function can not be redefine");
+            }
+            else
+                getNextToken();
+            continue;
+        case tok_def:
+        case tok_memo:
+        {
+            StageTimer timer(CompileStage::Parse);
+            item->function = parseDefinition();
+            if (item->function)
+                timer.setFunction(item->function->getPrototype().getName());
+        }
+            if (item->function && !declareFunction(item->function->getPrototype(), item->function))
+            {
+                logError("Function can not be redefine");
+                continue;
+            }
+            break;
+        default:
+            item->function = parseTopLevelExpression();
+            item->topLevel = true;
+            break;
+        }
+
+        if (!item->function)
+        {
+            getNextToken();
+            continue;
+        }
+        item->sequence = sequence++;
+        parsed.push(std::move(item));
+    }
+    lexer.reset();
+    parsed.close();
+    seconds = secondsSince(start);
+}
+
+// Generates and optimizes every function into a module of its own.
+static void codegenStage(BatchQueue &parsed, BatchQueue &generated, double &seconds)
+{
+    unique_ptr<BatchItem> item;
+    while (parsed.pop(item))
+    {
+        auto start = std::chrono::steady_clock::now();
+        initialModulesAndPassManager();
+        if (Function *function = item->function->codegen())
+        {
+            if (!item->topLevel)
+                createMapEntry(function);
+            item->module = takeCurrentModule();
+        }
+        else if (!item->topLevel)
+            forgetFunction(item->function->getPrototype().getNameId());
+        seconds += secondsSince(start);
+        generated.push(std::move(item));
+    }
+    generated.close();
+}
+
+int runBatch(StringRef path, unsigned codegenThreads, bool lazy, bool printIR)
+{
+    auto start = std::chrono::steady_clock::now();
+    codegenThreads = std::max(codegenThreads, 1u);
+    BatchQueue parsed(1024, 1), generated(1024, codegenThreads);
+
+    double parseSeconds = 0;
+    std::vector<double> codegenSeconds(codegenThreads);
+    std::thread parser(parseStage, path, std::ref(parsed), std::ref(parseSeconds));
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < codegenThreads; i++)
+        workers.emplace_back(codegenStage, std::ref(parsed), std::ref(generated), std::ref(codegenSeconds[i]));
+
+    // Items leave code generation out of order; they are added to the JIT,
+    // and expressions run, in source order.
+    std::map<uint64_t, unique_ptr<BatchItem>> waiting;
+    uint64_t nextSequence = 0;
+    std::vector<StringRef> definitions;
+    uint64_t expressions = 0;
+    unique_ptr<BatchItem> item;
+    while (generated.pop(item))
+    {
+        waiting[item->sequence] = std::move(item);
+        for (auto next = waiting.begin(); next != waiting.end() && next->first == nextSequence;
+             next = waiting.erase(next), nextSequence++)
+        {
+            BatchItem &ready = *next->second;
+            if (!ready.module)
+                continue;
+            if (printIR)
+                ready.module.withModuleDo([](Module &module)
+                                          { module.print(errs(), nullptr); });
+
+            if (ready.topLevel)
+            {
+                // A definition it calls may have failed after it was generated.
+                auto tracker = myJIT->getMainJITDylib().createResourceTracker();
+                exitOnError(myJIT->addModule(std::move(ready.module), tracker));
+                if (auto symbol = myJIT->lookup("__anon_expr"))
+                {
+                    double (*expression)() = (double (*)())(intptr_t)symbol->getAddress();
+                    fprintf(stderr, "Evaluated to %f\n", expression());
+                }
+                else
+                    logAllUnhandledErrors(symbol.takeError(), errs(), "Error: ");
+                exitOnError(myJIT->removeModule(tracker));
+                expressions++;
+                continue;
+            }
+
+            StringRef name = ready.function->getPrototype().getName();
+            if (lazy)
+                exitOnError(myJIT->addLazyModule(std::move(ready.module)));
+            else
+            {
+                exitOnError(myJIT->addModule(std::move(ready.module)));
+                myJIT->compileAhead(name);
+            }
+            definitions.push_back(name);
+        }
+    }
+
+    parser.join();
+    for (auto &worker : workers)
+        worker.join();
+
+    // Wait until the compile pool has finished every definition.
+    if (!lazy)
+        for (StringRef name : definitions)
+            consumeError(myJIT->lookup(name).takeError());
+
+    double seconds = secondsSince(start);
+    double totalCodegenSeconds = 0;
+    for (double workerSeconds : codegenSeconds)
+        totalCodegenSeconds += workerSeconds;
+    fprintf(stderr, "Batch: %zu definitions and %llu expressions in %.3f s: %.0f functions/s "
+                    "(parse %.3f s, IR generation %.3f s on %u threads)\n",
+            definitions.size(), (unsigned long long)expressions, seconds,
+            (definitions.size() + expressions) / seconds, parseSeconds, totalCodegenSeconds, codegenThreads);
+    return 0;
+}
@@ -0,0 +1,8 @@
+#include "llvm/ADT/StringRef.h"
+
+// Runs a file without the REPL: one thread parses it and declares every
+// prototype, codegenThreads threads generate and optimize IR into a module
+// per function, and this thread adds the modules to the JIT in source
+// order, which compiles them on its pool, and runs top-level expressions.
+// Bounded queues connect the stages. Reports functions per second.
+int runBatch(llvm::StringRef path, unsigned codegenThreads, bool lazy, bool printIR);
@@ -0,0 +1,50 @@
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+// A FIFO between two pipeline stages. Producers block while it is full, so
+// a fast stage can not run arbitrarily far ahead of the next one.
+template <typename T>
+class BoundedQueue
+{
+    std::deque<T> items;
+    size_t capacity;
+    unsigned openProducers;
+    std::mutex mutex;
+    std::condition_variable notFull, notEmpty;
+
+public:
+    BoundedQueue(size_t capacity, unsigned producers) : capacity(capacity), openProducers(producers) {}
+
+    void push(T item)
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->notFull.wait(lock, [this]
+                           { return this->items.size() < this->capacity; });
+        this->items.push_back(std::move(item));
+        this->notEmpty.notify_one();
+    }
+
+    // Called once by every producer when it is done.
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (--this->openProducers == 0)
+            this->notEmpty.notify_all();
+    }
+
+    // Returns false once every producer closed the queue and it is drained.
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->notEmpty.wait(lock, [this]
+                            { return !this->items.empty() || this->openProducers == 0; });
+        if (this->items.empty())
+            return false;
+        item = std::move(this->items.front());
+        this->items.pop_front();
+        this->notFull.notify_one();
+        return true;
+    }
+};
@@ -2,11 +2,25 @@
 #include "myJIT.h"
 #include "llvm/IR/Module.h"
 
-extern int curToken;
+// The lexer, parser and IR generation state is per thread, so threads can
+// compile independently while sharing myJIT.
+extern thread_local int curToken;
 
-extern std::string identifierStr;
-extern double numVal;
+extern thread_local double numVal;
 extern std::unique_ptr<llvm::orc::HadiJIT> myJIT;
-extern std::unique_ptr<llvm::Module> module;
-extern std::unique_ptr<llvm::LLVMContext> ctx;
-extern llvm::ExitOnError exitOnError;
\ No newline at end of file
+extern llvm::ExitOnError exitOnError;
+extern unsigned optimizationLevel;
+// The machine code generation level matching optimizationLevel.
+llvm::CodeGenOpt::Level getCodeGenOptLevel();
+extern bool timePhases;
+// Whether memo defs count their cache hits and misses.
+extern bool memoStatistics;
+// Whether generated functions carry source line debug info, for profilers
+// and debuggers.
+extern bool debugInfo;
+
+// The module the calling thread generates IR into.
+llvm::Module &getCurrentModule();
+// Hands the calling thread's module and its context over, e.g. to the JIT.
+// Call initialModulesAndPassManager before generating more IR.
+llvm::orc::ThreadSafeModule takeCurrentModule();
\ No newline at end of file
@@ -0,0 +1,258 @@
+#include "Parser.h"
+#include "Lexer.h"
+#include "Common.h"
+#include "Compiler.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+static bool compileDefinition(std::vector<unsigned> &names)
+{
+    shared_ptr<FunctionExpressionAST> funcAST;
+    {
+        StageTimer timer(CompileStage::Parse);
+        funcAST = parseDefinition();
+        if (funcAST)
+            timer.setFunction(funcAST->getPrototype().getName());
+    }
+    if (!funcAST)
+        return false;
+
+    if (!declareFunction(funcAST->getPrototype(), funcAST))
+    {
+        logError("Function can not be redefine");
+        return false;
+    }
+    names.push_back(funcAST->getPrototype().getNameId());
+
+    Function *function = funcAST->codegen();
+    if (!function)
+        return false;
+    createMapEntry(function);
+
+    return true;
+}
+
+// Externs are not owned by a module, so they are not added to names.
+static bool compileExtern()
+{
+    auto prototype = parseExtern();
+    if (!prototype)
+        return false;
+
+    if (!declareFunction(*prototype))
+    {
+        logError("Function can not be redefine");
+        return false;
+    }
+    return true;
+}
+
+bool compileDefinitions(std::vector<unsigned> &names)
+{
+    getNextToken();
+    while (curToken != tok_eof)
+    {
+        if (curToken == ';')
+        {
+            getNextToken();
+            continue;
+        }
+
+        bool compiled = curToken == tok_def || curToken == tok_memo || curToken == tok_extern;
+        if (!compiled)
+            logError("Expected a definition, top-level expressions can not be compiled");
+        else if (curToken == tok_extern)
+            compiled = compileExtern();
+        else
+            compiled = compileDefinition(names);
+
+        if (!compiled)
+        {
+            for (unsigned name : names)
+                forgetFunction(name);
+            names.clear();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool emitObject(TargetMachine *targetMachine, const string &objectFile)
+{
+    std::error_code errorCode;
+    raw_fd_ostream dest(objectFile, errorCode, sys::fs::OF_None);
+    if (errorCode)
+    {
+        errs() << "Could not open file: " << errorCode.message() << "\n";
+        return false;
+    }
+
+    legacy::PassManager passManager;
+    if (targetMachine->addPassesToEmitFile(passManager, dest, nullptr, CGFT_ObjectFile))
+    {
+        errs() << "The target can not emit an object file\n";
+        return false;
+    }
+
+    passManager.run(getCurrentModule());
+    dest.flush();
+    return true;
+}
+
+static const char *getCTypeName(Type *type)
+{
+    if (type->isIntegerTy())
+        return "int64_t";
+    return type->isFloatTy() ? "float" : "double";
+}
+
+static bool emitHeader(const string &headerFile)
+{
+    std::error_code errorCode;
+    raw_fd_ostream header(headerFile, errorCode, sys::fs::OF_Text);
+    if (errorCode)
+    {
+        errs() << "Could not open file: " << errorCode.message() << "\n";
+        return false;
+    }
+
+    string guard = sys::path::stem(headerFile).upper() + "_H";
+    for (char &c : guard)
+        if (!isalnum(c))
+            c = '_';
+
+    header << "#ifndef " << guard << "\n#define " << guard << "\n\n#include <stddef.h>\n#include <stdint.h>\n\n";
+    header << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+
+    for (Function &function : getCurrentModule().functions())
+    {
+        // Skip internal helpers such as the f_map.columns entries and
+        // specialized clones.
+        if (function.isDeclaration() || function.hasLocalLinkage() || function.getName().contains('.'))
+            continue;
+
+        // A map's columns have the types of the definition it evaluates.
+        bool isMap = function.getReturnType()->isVoidTy();
+        Function *mapped = isMap ? getCurrentModule().getFunction(function.getName().drop_back(4)) : &function;
+        header << (isMap ? "void" : getCTypeName(function.getReturnType())) << ' ' << function.getName() << "(";
+        for (auto &arg : function.args())
+        {
+            unsigned argNo = arg.getArgNo();
+            if (argNo)
+                header << ", ";
+            if (!isMap)
+                header << getCTypeName(arg.getType()) << ' ';
+            else if (arg.getType()->isIntegerTy())
+                header << "size_t ";
+            else if (argNo + 2 == function.arg_size())
+                header << getCTypeName(mapped->getReturnType()) << " *";
+            else
+                header << "const " << getCTypeName(mapped->getArg(argNo)->getType()) << " *";
+            header << arg.getName();
+        }
+        if (function.arg_empty())
+            header << "void";
+        header << ");\n";
+    }
+
+    // The hit and miss counters of memo defs.
+    for (GlobalVariable &global : getCurrentModule().globals())
+        if (!global.hasLocalLinkage())
+            header << "extern uint64_t " << global.getName() << ";\n";
+
+    header << "\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n";
+    return true;
+}
+
+static bool linkShared(const string &objectFile, const string &outputFile)
+{
+    auto linker = sys::findProgramByName("cc");
+    if (!linker)
+    {
+        errs() << "Could not find cc to link " << outputFile << "\n";
+        return false;
+    }
+
+    StringRef linkArgs[] = {*linker, "-shared", "-o", outputFile, objectFile};
+    string errorMessage;
+    if (sys::ExecuteAndWait(*linker, linkArgs, None, {}, 0, 0, &errorMessage))
+    {
+        errs() << "Linking " << outputFile << " failed " << errorMessage << "\n";
+        return false;
+    }
+
+    return true;
+}
+
+int compileFile(const string &inputFile, const string &outputFile, bool shared)
+{
+    lexer = Lexer::createForFile(inputFile);
+    if (!lexer)
+        return 1;
+
+    string targetTriple = sys::getDefaultTargetTriple();
+    string error;
+    auto target = TargetRegistry::lookupTarget(targetTriple, error);
+    if (!target)
+    {
+        errs() << error << "\n";
+        return 1;
+    }
+
+    TargetOptions options;
+    // Memo defs reference their tables and counters, so objects are position
+    // independent to link into PIE executables as well as shared libraries.
+    std::unique_ptr<TargetMachine> targetMachine(target->createTargetMachine(
+        targetTriple, "generic", "", options, Reloc::PIC_, None, getCodeGenOptLevel()));
+
+    initialModulesAndPassManager();
+    getCurrentModule().setTargetTriple(targetTriple);
+    getCurrentModule().setDataLayout(targetMachine->createDataLayout());
+
+    std::vector<unsigned> names;
+    if (!compileDefinitions(names))
+        return 1;
+
+    {
+        NamedRegionTimer timer("optimize-module", "Module optimization", "band", "Band compile phases", timePhases);
+        optimizeModule(targetMachine.get());
+    }
+
+    string objectFile = outputFile;
+    if (shared)
+    {
+        SmallString<128> tempPath;
+        if (sys::fs::createTemporaryFile("band", "o", tempPath))
+        {
+            errs() << "Could not create a temporary object file\n";
+            return 1;
+        }
+        objectFile = string(tempPath);
+    }
+
+    bool succeeded;
+    {
+        NamedRegionTimer timer("emit", "Object file emission", "band", "Band compile phases", timePhases);
+        succeeded = emitObject(targetMachine.get(), objectFile);
+    }
+    if (succeeded && shared)
+        succeeded = linkShared(objectFile, outputFile);
+    if (shared)
+        sys::fs::remove(objectFile);
+
+    SmallString<128> headerFile(outputFile);
+    sys::path::replace_extension(headerFile, "h");
+    if (!succeeded || !emitHeader(string(headerFile)))
+        return 1;
+
+    return 0;
+}
@@ -0,0 +1,8 @@
+#include <string>
+#include <vector>
+
+// Parses and generates IR for every definition the current lexer yields into
+// the current module, recording their symbol IDs in names. On error, every
+// definition registered so far is forgotten again.
+bool compileDefinitions(std::vector<unsigned> &names);
+int compileFile(const std::string &inputFile, const std::string &outputFile, bool shared);
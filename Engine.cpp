@@ -0,0 +1,252 @@
+#include "Parser.h"
+#include "Lexer.h"
+#include "Common.h"
+#include "Compiler.h"
+#include "Band.h"
+#include "Parallel.h"
+
+namespace band
+{
+    struct Engine::LoadedModule
+    {
+        orc::ResourceTrackerSP tracker;
+        std::vector<unsigned> names;
+    };
+
+    static Error makeError(const Twine &message)
+    {
+        return createStringError(inconvertibleErrorCode(), message);
+    }
+
+    // Rows of each column a parallel worker evaluates at a time; 16k rows
+    // of a few columns stay in L2.
+    static const uint64_t parallelChunkRows = 16384;
+
+    Engine::Engine() {}
+
+    Engine::~Engine()
+    {
+        for (auto &loaded : this->modules)
+            for (unsigned name : loaded.second->names)
+                forgetFunction(name);
+        this->modules.clear();
+        myJIT.reset();
+    }
+
+    Expected<std::unique_ptr<Engine>> Engine::create(unsigned optimizationLevel, bool memoStats)
+    {
+        if (myJIT)
+            return makeError("Only one Band engine can exist at a time");
+        if (optimizationLevel > 3)
+            return makeError("Invalid optimization level");
+        ::optimizationLevel = optimizationLevel;
+        memoStatistics = memoStats;
+
+        static bool initialized = false;
+        if (!initialized)
+        {
+            initializeNativeTargets();
+            initialBinOpPrecs();
+            initialized = true;
+        }
+
+        auto jit = orc::HadiJIT::Create(getCodeGenOptLevel());
+        if (!jit)
+            return jit.takeError();
+        myJIT = std::move(*jit);
+
+        return std::unique_ptr<Engine>(new Engine());
+    }
+
+    Expected<ModuleHandle> Engine::compile(StringRef source)
+    {
+        // The calling thread may never have compiled before, and a module
+        // left over from a failed compile must not leak into this one.
+        initialModulesAndPassManager();
+
+        std::unique_ptr<Lexer> previousLexer = std::move(lexer);
+        lexer = std::make_unique<Lexer>(MemoryBuffer::getMemBufferCopy(source, "<engine>"));
+
+        auto loaded = std::make_unique<LoadedModule>();
+        bool compiled = compileDefinitions(loaded->names);
+        lexer = std::move(previousLexer);
+
+        if (!compiled)
+            return makeError("Could not compile the source");
+
+        loaded->tracker = myJIT->getMainJITDylib().createResourceTracker();
+        Error error = myJIT->addModule(takeCurrentModule(), loaded->tracker);
+        if (error)
+        {
+            for (unsigned name : loaded->names)
+                forgetFunction(name);
+            return std::move(error);
+        }
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+        unsigned id = this->nextModuleId++;
+        this->modules[id] = std::move(loaded);
+        return ModuleHandle(id);
+    }
+
+    Error Engine::unload(ModuleHandle handle)
+    {
+        std::unique_ptr<LoadedModule> loaded;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto moduleIter = this->modules.find(handle.id);
+            if (moduleIter == this->modules.end())
+                return makeError("Unknown module");
+
+            loaded = std::move(moduleIter->second);
+            this->modules.erase(moduleIter);
+
+            for (unsigned name : loaded->names)
+            {
+                StringRef functionName = symbols.getName(name);
+                this->functions.erase(functionName);
+                this->functions.erase((functionName + "_map.columns").str());
+                forgetFunction(name);
+            }
+        }
+
+        return myJIT->removeModule(loaded->tracker);
+    }
+
+    // Spells a signature the way a prototype declares it, e.g. (f32 f32):f32.
+    static std::string describeSignature(StringRef signature)
+    {
+        std::string description = "(";
+        for (char code : signature.drop_front())
+        {
+            if (description.size() > 1)
+                description += ' ';
+            description += getValueTypeName((ValueType)code).str();
+        }
+        return description + "):" + getValueTypeName((ValueType)signature.front()).str();
+    }
+
+    Expected<uint64_t> Engine::lookup(StringRef name, StringRef signature)
+    {
+        CachedFunction function;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto functionIter = this->functions.find(name);
+            function = functionIter == this->functions.end() ? CachedFunction{0, ""} : functionIter->second;
+        }
+
+        if (!function.address)
+        {
+            int symbol = symbols.find(name);
+            std::string expectedSignature = symbol < 0 ? "" : getFunctionSignature(symbol);
+            if (expectedSignature.empty())
+                return makeError("Unknown function " + name);
+
+            // Looking up may compile the function, so other threads keep
+            // using the cache meanwhile. Racing lookups get the same address.
+            auto address = myJIT->lookup(name);
+            if (!address)
+                return address.takeError();
+
+            function = {address->getAddress(), expectedSignature};
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->functions[name] = function;
+        }
+
+        if (signature.empty() || signature == function.signature)
+            return function.address;
+        if (signature.size() != function.signature.size())
+            return makeError("Function " + name + " takes " + Twine(function.signature.size() - 1) + " arguments");
+        return makeError("Function " + name + " is declared as " + describeSignature(function.signature));
+    }
+
+    Error Engine::addSymbol(StringRef name, uint64_t address)
+    {
+        return myJIT->addRuntimeSymbol(name, address);
+    }
+
+    Expected<ColumnMapFunction> Engine::getColumnMap(StringRef name)
+    {
+        std::string columnsName = (name + "_map.columns").str();
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto functionIter = this->functions.find(columnsName);
+            if (functionIter != this->functions.end())
+                return reinterpret_cast<ColumnMapFunction>(static_cast<uintptr_t>(functionIter->second.address));
+        }
+
+        if (auto error = this->lookup(name, "").takeError())
+            return std::move(error);
+
+        auto columnMap = myJIT->lookupColumnMap(name);
+        if (!columnMap)
+            return columnMap.takeError();
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->functions[columnsName] = {reinterpret_cast<uintptr_t>(*columnMap), ""};
+        return *columnMap;
+    }
+
+    ParallelRunner &Engine::getRunner()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (!this->runner)
+            this->runner = std::make_unique<ParallelRunner>(this->parallelThreads ? this->parallelThreads
+                                                                                  : std::thread::hardware_concurrency());
+        return *this->runner;
+    }
+
+    void Engine::setParallelThreads(unsigned threads)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->parallelThreads = threads;
+        this->runner.reset();
+    }
+
+    Expected<double> Engine::evaluateParallel(StringRef name, const double *const *columns, double *out, uint64_t rows,
+                                              Reduction reduction)
+    {
+        auto columnMap = this->getColumnMap(name);
+        if (!columnMap)
+            return columnMap.takeError();
+
+        double result = getReductionIdentity(reduction);
+        ArrayRef<const double *> columnList(columns, getFunctionArity(symbols.find(name)));
+        mapRows(this->getRunner(), *columnMap, columnList, out, rows, parallelChunkRows, reduction, result);
+        return reduction == Reduction::None ? 0 : result;
+    }
+
+    double *Engine::allocateRows(uint64_t rows)
+    {
+        return ::allocateRows(this->getRunner(), rows, parallelChunkRows);
+    }
+
+    void Engine::freeRows(double *rows, uint64_t count)
+    {
+        ::freeRows(rows, count);
+    }
+
+    Expected<MemoStats> Engine::getMemoStats(StringRef name)
+    {
+        if (auto error = this->lookup(name, "").takeError())
+            return std::move(error);
+        if (!memoStatistics)
+            return makeError("Memo counters are off; create the engine with memoStats");
+
+        auto hits = myJIT->lookup((name + "_memo_hits").str());
+        if (!hits)
+        {
+            consumeError(hits.takeError());
+            return makeError("Function " + name + " is not a memo def");
+        }
+        auto misses = myJIT->lookup((name + "_memo_misses").str());
+        if (!misses)
+            return misses.takeError();
+
+        // Compiled code bumps the counters atomically.
+        MemoStats stats;
+        stats.hits = __atomic_load_n(reinterpret_cast<uint64_t *>(hits->getAddress()), __ATOMIC_RELAXED);
+        stats.misses = __atomic_load_n(reinterpret_cast<uint64_t *>(misses->getAddress()), __ATOMIC_RELAXED);
+        return stats;
+    }
+} // namespace band
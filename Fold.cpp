@@ -0,0 +1,92 @@
+#include "AST.h"
+#include "llvm/ADT/SmallVector.h"
+
+// Constant folding over a parsed body, before it is interpreted or compiled.
+// Only numbers, arithmetic on them, untaken if arms and math builtins of
+// constants fold; variables may be assigned and definitions may print, so
+// anything reading them stays. Each node folds its children in place and
+// returns its replacement.
+
+static ExpressionAST *makeNumber(ASTArena &arena, double value)
+{
+    return new (arena) NumberExpAST(value);
+}
+
+void FunctionExpressionAST::fold()
+{
+    this->body = this->body->fold(*this->arena);
+}
+
+ExpressionAST *AssignExpAST::fold(ASTArena &arena)
+{
+    this->value = this->value->fold(arena);
+    return this;
+}
+
+ExpressionAST *VarExpressionAST::fold(ASTArena &arena)
+{
+    for (auto &var : this->vars)
+        if (var.second)
+            var.second = var.second->fold(arena);
+    this->body = this->body->fold(arena);
+    return this;
+}
+
+ExpressionAST *BinaryExpAST::fold(ASTArena &arena)
+{
+    this->lhs = this->lhs->fold(arena);
+    this->rhs = this->rhs->fold(arena);
+
+    double leftHandSide, rightHandSide;
+    if (!this->lhs->getConstant(leftHandSide))
+        return this;
+
+    // A constant left of ':' has no effect.
+    if (this->op == ':')
+        return this->rhs;
+
+    if (!this->rhs->getConstant(rightHandSide))
+        return this;
+
+    // The interpreter computes the same value codegen would.
+    return makeNumber(arena, this->eval());
+}
+
+ExpressionAST *CallExpressionAST::fold(ASTArena &arena)
+{
+    SmallVector<double, 4> argValues;
+    for (ExpressionAST *&arg : this->args)
+    {
+        arg = arg->fold(arena);
+        double value;
+        if (arg->getConstant(value))
+            argValues.push_back(value);
+    }
+
+    double result;
+    if (argValues.size() == this->args.size() && evaluateBuiltin(this->funcName, argValues, result))
+        return makeNumber(arena, result);
+    return this;
+}
+
+ExpressionAST *IfExpressionAST::fold(ASTArena &arena)
+{
+    this->cond = this->cond->fold(arena);
+    this->thenStmt = this->thenStmt->fold(arena);
+    this->elseStmt = this->elseStmt->fold(arena);
+
+    double condition;
+    if (!this->cond->getConstant(condition))
+        return this;
+    return condition < 0.0 || condition > 0.0 ? this->thenStmt : this->elseStmt;
+}
+
+ExpressionAST *ForExpressionAST::fold(ASTArena &arena)
+{
+    this->start = this->start->fold(arena);
+    this->end = this->end->fold(arena);
+    if (this->step)
+        this->step = this->step->fold(arena);
+    this->body = this->body->fold(arena);
+    return this;
+}
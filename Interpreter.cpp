@@ -0,0 +1,413 @@
+#include "Parser.h"
+#include "Common.h"
+#include "Interpreter.h"
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include "llvm/ADT/SmallVector.h"
+#include <mutex>
+#include <thread>
+
+struct TieredFunction
+{
+    shared_ptr<FunctionExpressionAST> definition;
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> loopIterations{0};
+    std::atomic<bool> queued{false};
+    std::atomic<double (*)(const double *)> compiled{nullptr};
+
+    // Only touched by the compile thread.
+    bool emitted = false;
+    bool failed = false;
+};
+
+struct EvalValue
+{
+    double value = 0.0;
+    bool bound = false;
+};
+
+static vector<unique_ptr<TieredFunction>> tieredFunctions;
+static std::mutex tieredFunctionsMutex;
+
+static thread_local vector<EvalValue> evalValues;
+static thread_local TieredFunction *currentFunction = nullptr;
+static thread_local bool evalFailed = false;
+
+static unsigned tierThreshold;
+static std::thread compileThread;
+static std::mutex compileQueueMutex;
+static std::condition_variable compileQueueCondition;
+static std::deque<TieredFunction *> compileQueue;
+static bool stopCompileThread = false;
+
+static double logErrorEval(const char *errStr)
+{
+    if (!evalFailed)
+        logError(errStr);
+    evalFailed = true;
+    return NAN;
+}
+
+static EvalValue &evalValue(unsigned name)
+{
+    if (name >= evalValues.size())
+        evalValues.resize(symbols.size());
+    return evalValues[name];
+}
+
+static TieredFunction *findTieredFunction(unsigned name)
+{
+    std::lock_guard<std::mutex> lock(tieredFunctionsMutex);
+    if (name >= tieredFunctions.size())
+        return nullptr;
+    return tieredFunctions[name].get();
+}
+
+static void countExecution(TieredFunction *function, std::atomic<uint64_t> &counter)
+{
+    ++counter;
+    if (function->calls + function->loopIterations < tierThreshold)
+        return;
+
+    if (function->queued.exchange(true))
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(compileQueueMutex);
+        compileQueue.push_back(function);
+    }
+    compileQueueCondition.notify_one();
+}
+
+static void compileHotFunction(TieredFunction *function)
+{
+    unsigned name = function->definition->getPrototype().getNameId();
+
+    std::vector<TieredFunction *> worklist{function};
+    std::vector<TieredFunction *> emitting;
+    std::vector<llvm::orc::ThreadSafeModule> modules;
+    while (!worklist.empty())
+    {
+        TieredFunction *next = worklist.back();
+        worklist.pop_back();
+        if (next->emitted || find(emitting.begin(), emitting.end(), next) != emitting.end())
+            continue;
+
+        if (next->failed)
+        {
+            function->failed = true;
+            return;
+        }
+
+        initialModulesAndPassManager();
+        if (!next->definition->codegen())
+        {
+            next->failed = function->failed = true;
+            return;
+        }
+
+        for (Function &declared : getCurrentModule().functions())
+            if (declared.isDeclaration())
+            {
+                int calleeName = symbols.find(declared.getName());
+                if (calleeName < 0)
+                    continue;
+                if (TieredFunction *callee = findTieredFunction(calleeName))
+                    worklist.push_back(callee);
+            }
+
+        emitting.push_back(next);
+        modules.push_back(takeCurrentModule());
+    }
+
+    for (auto &threadSafeModule : modules)
+        exitOnError(myJIT->addModule(std::move(threadSafeModule)));
+    for (TieredFunction *emitted : emitting)
+        emitted->emitted = true;
+
+    initialModulesAndPassManager();
+    createArrayEntry(getFunction(name));
+    exitOnError(myJIT->addModule(takeCurrentModule()));
+
+    auto entrySymbol = exitOnError(myJIT->lookup((symbols.getName(name) + ".entry").str()));
+    function->compiled.store((double (*)(const double *))(intptr_t)entrySymbol.getAddress(),
+                             std::memory_order_release);
+}
+
+static void compileThreadLoop()
+{
+    while (true)
+    {
+        TieredFunction *function;
+        {
+            std::unique_lock<std::mutex> lock(compileQueueMutex);
+            compileQueueCondition.wait(lock, []
+                                       { return stopCompileThread || !compileQueue.empty(); });
+            if (stopCompileThread)
+                return;
+
+            function = compileQueue.front();
+            compileQueue.pop_front();
+        }
+
+        compileHotFunction(function);
+    }
+}
+
+void initialTieredRuntime(unsigned threshold)
+{
+    tierThreshold = threshold;
+    compileThread = std::thread(compileThreadLoop);
+}
+
+void shutdownTieredRuntime()
+{
+    {
+        std::lock_guard<std::mutex> lock(compileQueueMutex);
+        stopCompileThread = true;
+    }
+    compileQueueCondition.notify_one();
+    compileThread.join();
+}
+
+void addTieredFunction(shared_ptr<FunctionExpressionAST> function)
+{
+    unsigned name = function->getPrototype().getNameId();
+    auto tieredFunction = make_unique<TieredFunction>();
+    tieredFunction->definition = move(function);
+
+    std::lock_guard<std::mutex> lock(tieredFunctionsMutex);
+    if (name >= tieredFunctions.size())
+        tieredFunctions.resize(symbols.size());
+    tieredFunctions[name] = move(tieredFunction);
+}
+
+bool evaluateTopLevel(FunctionExpressionAST &expression, double &result)
+{
+    evalFailed = false;
+    currentFunction = nullptr;
+    result = expression.eval({});
+    return !evalFailed;
+}
+
+// The interpreter computes everything in double. Typed values are only
+// rounded where they are passed, returned or converted, so until a typed
+// definition is compiled its f32 results may differ in the last bits and
+// its i64 arithmetic does not wrap.
+double FunctionExpressionAST::eval(const vector<double> &argValues)
+{
+    const vector<unsigned> &argNames = this->prototype->getArgs();
+    const vector<ValueType> &argTypes = this->prototype->getArgTypes();
+    SmallVector<EvalValue, 8> shadowed;
+    for (unsigned i = 0; i < argNames.size(); i++)
+    {
+        shadowed.push_back(evalValue(argNames[i]));
+        evalValue(argNames[i]) = {convertValue(argTypes[i], argValues[i]), true};
+    }
+
+    double result = this->body->eval();
+
+    for (unsigned i = argNames.size(); i-- > 0;)
+        evalValue(argNames[i]) = shadowed[i];
+
+    return convertValue(this->prototype->getReturnType(), result);
+}
+
+double NumberExpAST::eval()
+{
+    return this->value;
+}
+
+double VariableExpAST::eval()
+{
+    const EvalValue &value = evalValue(this->name);
+    if (!value.bound)
+        return logErrorEval("Unknown variable name");
+
+    return value.value;
+}
+
+double AssignExpAST::eval()
+{
+    double value = this->value->eval();
+
+    EvalValue &variable = evalValue(this->name);
+    if (!variable.bound)
+        return logErrorEval("Unknown variable name");
+
+    variable.value = value;
+    return value;
+}
+
+double VarExpressionAST::eval()
+{
+    SmallVector<EvalValue, 4> shadowed;
+    for (auto &var : this->vars)
+    {
+        double initValue = var.second ? var.second->eval() : 0.0;
+        shadowed.push_back(evalValue(var.first));
+        evalValue(var.first) = {initValue, true};
+    }
+
+    double result = this->body->eval();
+
+    for (unsigned i = shadowed.size(); i-- > 0;)
+        evalValue(this->vars[i].first) = shadowed[i];
+
+    return result;
+}
+
+double BinaryExpAST::eval()
+{
+    double leftHandSide = this->lhs->eval();
+    double rightHandSide = this->rhs->eval();
+
+    switch (this->op)
+    {
+    case '+':
+        return leftHandSide + rightHandSide;
+
+    case '-':
+        return leftHandSide - rightHandSide;
+
+    case '*':
+        return leftHandSide * rightHandSide;
+
+    case '<':
+        return !(leftHandSide >= rightHandSide) ? 1.0 : 0.0;
+
+    case ':':
+        return rightHandSide;
+
+    default:
+        return logErrorEval("Unknown operation");
+    }
+}
+
+// Calls a math builtin or an extern through the address the JIT resolves
+// for it, which is the function compiled code would call.
+static double callExtern(uint64_t address, const std::vector<double> &args)
+{
+    typedef double (*Unary)(double);
+    typedef double (*Binary)(double, double);
+    typedef double (*Ternary)(double, double, double);
+    typedef double (*Quaternary)(double, double, double, double);
+
+    switch (args.size())
+    {
+    case 0:
+        return ((double (*)())address)();
+    case 1:
+        return ((Unary)address)(args[0]);
+    case 2:
+        return ((Binary)address)(args[0], args[1]);
+    case 3:
+        return ((Ternary)address)(args[0], args[1], args[2]);
+    case 4:
+        return ((Quaternary)address)(args[0], args[1], args[2], args[3]);
+    default:
+        return logErrorEval("Externs with more than 4 arguments can not be interpreted");
+    }
+}
+
+double CallExpressionAST::eval()
+{
+    ValueType conversion;
+    if (!this->callee && !this->externAddress && getConversionType(this->funcName, conversion))
+    {
+        if (this->args.size() != 1)
+            return logErrorEval("A conversion takes one argument");
+        return convertValue(conversion, this->args[0]->eval());
+    }
+
+    if (!this->callee && !this->externAddress)
+    {
+        this->callee = findTieredFunction(this->funcName);
+        if (!this->callee)
+        {
+            int arity = getFunctionArity(this->funcName);
+            if (arity < 0)
+                arity = getBuiltinArity(this->funcName);
+            if (arity < 0)
+                return logErrorEval("Unknown function");
+            if (arity != (int)this->args.size())
+                return logErrorEval("Incorrect number of arguments");
+
+            auto symbol = myJIT->lookupExtern(symbols.getName(this->funcName));
+            if (!symbol)
+            {
+                consumeError(symbol.takeError());
+                return logErrorEval("Unknown extern");
+            }
+            this->externAddress = symbol->getAddress();
+        }
+    }
+
+    if (this->externAddress)
+    {
+        std::vector<double> argValues;
+        for (ExpressionAST *arg : this->args)
+            argValues.push_back(arg->eval());
+        return callExtern(this->externAddress, argValues);
+    }
+
+    if (this->callee->definition->getPrototype().getArgs().size() != this->args.size())
+        return logErrorEval("Incorrect number of arguments");
+
+    std::vector<double> argValues;
+    for (ExpressionAST *arg : this->args)
+        argValues.push_back(arg->eval());
+
+    if (auto *compiled = this->callee->compiled.load(std::memory_order_acquire))
+        return compiled(argValues.data());
+
+    countExecution(this->callee, this->callee->calls);
+
+    TieredFunction *caller = currentFunction;
+    currentFunction = this->callee;
+    double result = this->callee->definition->eval(argValues);
+    currentFunction = caller;
+
+    return result;
+}
+
+double IfExpressionAST::eval()
+{
+    double conditionValue = this->cond->eval();
+
+    if (conditionValue < 0.0 || conditionValue > 0.0)
+        return this->thenStmt->eval();
+
+    return this->elseStmt->eval();
+}
+
+double ForExpressionAST::eval()
+{
+    double value = this->start->eval();
+
+    EvalValue shadowed = evalValue(this->varName);
+    evalValue(this->varName) = {value, true};
+
+    while (!evalFailed)
+    {
+        this->body->eval();
+
+        double stepValue = this->step ? this->step->eval() : 1.0;
+        double nextValue = evalValue(this->varName).value + stepValue;
+
+        double endCondition = this->end->eval();
+        evalValue(this->varName).value = nextValue;
+
+        if (currentFunction)
+            countExecution(currentFunction, currentFunction->loopIterations);
+
+        if (!(endCondition < 0.0 || endCondition > 0.0))
+            break;
+    }
+
+    evalValue(this->varName) = shadowed;
+
+    return 0.0;
+}
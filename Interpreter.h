@@ -0,0 +1,8 @@
+#include <memory>
+
+class FunctionExpressionAST;
+
+void initialTieredRuntime(unsigned threshold);
+void shutdownTieredRuntime();
+void addTieredFunction(std::shared_ptr<FunctionExpressionAST> function);
+bool evaluateTopLevel(FunctionExpressionAST &expression, double &result);
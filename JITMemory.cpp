@@ -0,0 +1,181 @@
+#include "JITMemory.h"
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
+#include "llvm/ExecutionEngine/Orc/Shared/AllocationActions.h"
+#include "llvm/Support/Process.h"
+#include <cstring>
+
+using namespace llvm;
+using namespace llvm::jitlink;
+
+// The pages of one object between allocation and finalization. Standard
+// segments come first and stay until the object is removed; finalize
+// segments follow them and are given back once finalization ran.
+class SlabMemoryManager::SlabInFlightAlloc : public JITLinkMemoryManager::InFlightAlloc
+{
+    SlabMemoryManager &manager;
+    LinkGraph &graph;
+    BasicLayout layout;
+    char *base;
+    uint64_t standardSize;
+    uint64_t finalizeSize;
+
+    Error applyProtections()
+    {
+        for (auto &groupAndSegment : this->layout.segments())
+        {
+            auto &segment = groupAndSegment.second;
+            auto protections = toSysMemoryProtectionFlags(groupAndSegment.first.getMemProt());
+            sys::MemoryBlock block(segment.WorkingMem,
+                                   alignTo(segment.ContentSize + segment.ZeroFillSize, this->manager.pageSize));
+            if (auto error = sys::Memory::protectMappedMemory(block, protections))
+                return errorCodeToError(error);
+            if (protections & sys::Memory::MF_EXEC)
+                sys::Memory::InvalidateInstructionCache(block.base(), block.allocatedSize());
+        }
+        return Error::success();
+    }
+
+public:
+    SlabInFlightAlloc(SlabMemoryManager &manager, LinkGraph &graph, BasicLayout layout, char *base,
+                      uint64_t standardSize, uint64_t finalizeSize)
+        : manager(manager), graph(graph), layout(std::move(layout)), base(base), standardSize(standardSize),
+          finalizeSize(finalizeSize)
+    {
+    }
+
+    void finalize(OnFinalizedFunction onFinalized) override
+    {
+        if (auto error = this->applyProtections())
+            return onFinalized(std::move(error));
+
+        auto deallocActions = orc::shared::runFinalizeActions(this->graph.allocActions());
+        if (!deallocActions)
+            return onFinalized(deallocActions.takeError());
+
+        if (this->finalizeSize)
+            if (auto error = this->manager.releasePages(this->base + this->standardSize, this->finalizeSize))
+                return onFinalized(std::move(error));
+
+        auto *alloc = new SlabAlloc{this->base, this->standardSize, std::move(*deallocActions)};
+        onFinalized(FinalizedAlloc(orc::ExecutorAddr::fromPtr(alloc)));
+    }
+
+    void abandon(OnAbandonedFunction onAbandoned) override
+    {
+        onAbandoned(this->manager.releasePages(this->base, this->standardSize + this->finalizeSize));
+    }
+};
+
+SlabMemoryManager::SlabMemoryManager(uint64_t slabSize)
+    : pageSize(sys::Process::getPageSizeEstimate()), slabSize(alignTo(slabSize, pageSize))
+{
+}
+
+SlabMemoryManager::~SlabMemoryManager()
+{
+    for (sys::MemoryBlock &slab : this->slabs)
+        sys::Memory::releaseMappedMemory(slab);
+}
+
+// Takes the first free run that fits, so objects pack toward the start of
+// the first slab, and maps a new slab when none does.
+Expected<char *> SlabMemoryManager::takePages(uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto run = this->freeRuns.begin();
+    while (run != this->freeRuns.end() && run->second < size)
+        ++run;
+    if (run == this->freeRuns.end())
+    {
+        std::error_code error;
+        sys::MemoryBlock slab = sys::Memory::allocateMappedMemory(
+            std::max(size, this->slabSize), nullptr, sys::Memory::MF_READ | sys::Memory::MF_WRITE, error);
+        if (error)
+            return errorCodeToError(error);
+        this->slabs.push_back(slab);
+        run = this->freeRuns.insert({(char *)slab.base(), slab.allocatedSize()}).first;
+    }
+
+    char *base = run->first;
+    uint64_t rest = run->second - size;
+    this->freeRuns.erase(run);
+    if (rest)
+        this->freeRuns[base + size] = rest;
+    return base;
+}
+
+Error SlabMemoryManager::releasePages(char *base, uint64_t size)
+{
+    // The next object that gets these pages writes to them before it sets
+    // its own protections.
+    if (auto error = sys::Memory::protectMappedMemory(sys::MemoryBlock(base, size),
+                                                      sys::Memory::MF_READ | sys::Memory::MF_WRITE))
+        return errorCodeToError(error);
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto next = this->freeRuns.lower_bound(base);
+    if (next != this->freeRuns.end() && base + size == next->first)
+    {
+        size += next->second;
+        next = this->freeRuns.erase(next);
+    }
+    if (next != this->freeRuns.begin())
+    {
+        auto previous = std::prev(next);
+        if (previous->first + previous->second == base)
+        {
+            previous->second += size;
+            return Error::success();
+        }
+    }
+    this->freeRuns[base] = size;
+    return Error::success();
+}
+
+void SlabMemoryManager::allocate(const JITLinkDylib *dylib, LinkGraph &graph, OnAllocatedFunction onAllocated)
+{
+    BasicLayout layout(graph);
+    auto sizes = layout.getContiguousPageBasedLayoutSizes(this->pageSize);
+    if (!sizes)
+        return onAllocated(sizes.takeError());
+
+    auto base = this->takePages(sizes->total());
+    if (!base)
+        return onAllocated(base.takeError());
+    // Reused pages hold the code of an earlier object, and zero-fill
+    // segments expect zeros.
+    memset(*base, 0, sizes->total());
+
+    char *nextStandard = *base;
+    char *nextFinalize = *base + sizes->StandardSegs;
+    for (auto &groupAndSegment : layout.segments())
+    {
+        auto &segment = groupAndSegment.second;
+        char *&next = groupAndSegment.first.getMemDeallocPolicy() == MemDeallocPolicy::Standard ? nextStandard
+                                                                                                 : nextFinalize;
+        segment.WorkingMem = next;
+        segment.Addr = orc::ExecutorAddr::fromPtr(next);
+        next += alignTo(segment.ContentSize + segment.ZeroFillSize, this->pageSize);
+    }
+
+    if (auto error = layout.apply())
+    {
+        consumeError(this->releasePages(*base, sizes->total()));
+        return onAllocated(std::move(error));
+    }
+    onAllocated(std::make_unique<SlabInFlightAlloc>(*this, graph, std::move(layout), *base, sizes->StandardSegs,
+                                                    sizes->FinalizeSegs));
+}
+
+void SlabMemoryManager::deallocate(std::vector<FinalizedAlloc> allocs, OnDeallocatedFunction onDeallocated)
+{
+    Error errors = Error::success();
+    for (FinalizedAlloc &finalized : allocs)
+    {
+        auto *alloc = finalized.release().toPtr<SlabAlloc *>();
+        errors = joinErrors(std::move(errors), orc::shared::runDeallocActions(alloc->deallocActions));
+        errors = joinErrors(std::move(errors), this->releasePages(alloc->base, alloc->size));
+        delete alloc;
+    }
+    onDeallocated(std::move(errors));
+}
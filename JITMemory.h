@@ -0,0 +1,52 @@
+#include "llvm/ExecutionEngine/JITLink/JITLinkMemoryManager.h"
+#include "llvm/Support/Memory.h"
+#include <map>
+#include <mutex>
+#include <vector>
+
+// Gives JITLink the memory of each object it links from a few large slabs,
+// and reuses the pages of removed objects for later ones. The memory manager
+// JITLink uses by default maps and unmaps memory for every object, so a REPL
+// that compiles and removes an expression per line pays for those calls and
+// new page faults each time, and leaves the address space fragmented.
+//
+// An object gets one contiguous run of pages, so its code and data stay
+// within reach of each other's relocations. Pages are writable while the
+// object is linked and get their final protections when it is finalized,
+// never writable and executable at once. A removed object's pages are made
+// writable again and kept, still resident, for the next object that fits;
+// slabs are only unmapped with the manager.
+class SlabMemoryManager : public llvm::jitlink::JITLinkMemoryManager
+{
+    class SlabInFlightAlloc;
+
+    // A finalized object: its pages and the actions that undo finalization,
+    // such as deregistering its EH frames.
+    struct SlabAlloc
+    {
+        char *base;
+        uint64_t size;
+        std::vector<llvm::orc::shared::WrapperFunctionCall> deallocActions;
+    };
+
+    uint64_t pageSize;
+    uint64_t slabSize;
+    std::mutex mutex;
+    std::vector<llvm::sys::MemoryBlock> slabs;
+    // Free runs of pages by start address, with neighbours merged.
+    std::map<char *, uint64_t> freeRuns;
+
+    llvm::Expected<char *> takePages(uint64_t size);
+    llvm::Error releasePages(char *base, uint64_t size);
+
+public:
+    explicit SlabMemoryManager(uint64_t slabSize = 16 << 20);
+    ~SlabMemoryManager();
+
+    void allocate(const llvm::jitlink::JITLinkDylib *dylib, llvm::jitlink::LinkGraph &graph,
+                  OnAllocatedFunction onAllocated) override;
+    using JITLinkMemoryManager::allocate;
+
+    void deallocate(std::vector<FinalizedAlloc> allocs, OnDeallocatedFunction onDeallocated) override;
+    using JITLinkMemoryManager::deallocate;
+};
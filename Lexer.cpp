@@ -1,68 +1,162 @@
 #include <iostream>
 #include "Lexer.h"
 #include "Common.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/raw_ostream.h"
 
-std::string identifierStr;
-double numVal;
-int lastChar = ' ';
+thread_local double numVal;
+thread_local std::unique_ptr<Lexer> lexer;
 
 using namespace std;
 
-int getToken()
+static int getKeyword(llvm::StringRef word)
 {
-    while (isspace(lastChar))
-        lastChar = getchar();
-
-    if (isalpha(lastChar))
+    switch (word.size())
     {
-        identifierStr = lastChar;
-        while (isalnum(lastChar = getchar()))
-            identifierStr += lastChar;
-
-        if (identifierStr == "def")
-            return tok_def;
-        if (identifierStr == "if")
+    case 2:
+        if (word == "if")
             return tok_if;
-        if (identifierStr == "then")
+        if (word == "in")
+            return tok_in;
+        break;
+    case 3:
+        if (word == "def")
+            return tok_def;
+        if (word == "for")
+            return tok_for;
+        if (word == "var")
+            return tok_var;
+        break;
+    case 4:
+        if (word == "then")
             return tok_then;
-        if (identifierStr == "else")
+        if (word == "else")
             return tok_else;
-        if (identifierStr == "for")
-            return tok_for;
-        if (identifierStr == "in")
-            return tok_in;
-        return tok_identifier;
+        if (word == "memo")
+            return tok_memo;
+        break;
+    case 6:
+        if (word == "extern")
+            return tok_extern;
+        break;
     }
-    else if (isdigit(lastChar) || lastChar == '.')
+    return tok_identifier;
+}
+
+Lexer::Lexer(unique_ptr<llvm::MemoryBuffer> buffer) : buffer(move(buffer))
+{
+    this->current = this->lineStart = this->buffer->getBufferStart();
+    this->end = this->buffer->getBufferEnd();
+    this->bytesRead = this->buffer->getBufferSize();
+}
+
+Lexer::~Lexer()
+{
+    free(this->lineBuffer);
+}
+
+unique_ptr<Lexer> Lexer::createForFile(llvm::StringRef path)
+{
+    auto buffer = llvm::MemoryBuffer::getFile(path, false, false);
+    if (!buffer)
     {
-        string numStr = "";
-        bool isDot = false;
+        llvm::errs() << "Could not open " << path << ": " << buffer.getError().message() << "\n";
+        return nullptr;
+    }
 
-        if (lastChar == '.')
-            isDot = true;
+    return make_unique<Lexer>(move(*buffer));
+}
 
-        do
+bool Lexer::refill()
+{
+    if (this->buffer)
+        return false;
+
+    ssize_t length = getline(&this->lineBuffer, &this->lineCapacity, stdin);
+    if (length <= 0)
+        return false;
+
+    this->current = this->lineStart = this->lineBuffer;
+    this->end = this->lineBuffer + length;
+    this->bytesRead += length;
+    return true;
+}
+
+Lexeme Lexer::next()
+{
+    Lexeme lexeme;
+
+    while (true)
+    {
+        if (this->current == this->end && !this->refill())
+        {
+            lexeme.location = {this->line, (unsigned)(this->current - this->lineStart) + 1};
+            return this->lastLexeme = lexeme;
+        }
+
+        unsigned char c = *this->current;
+        if (c == '\n')
+        {
+            this->lineStart = ++this->current;
+            this->line++;
+        }
+        else if (isspace(c))
+            this->current++;
+        else if (c == '#')
         {
-            numStr += lastChar;
-            lastChar = getchar();
-        } while (isdigit(lastChar) || (lastChar == '.' && !isDot));
+            while (this->current != this->end && *this->current != '\n')
+                this->current++;
+        }
+        else
+            break;
+    }
 
-        numVal = strtod(numStr.c_str(), 0);
-        return tok_number;
+    const char *start = this->current;
+    unsigned char first = *start;
+    lexeme.location = {this->line, (unsigned)(start - this->lineStart) + 1};
+
+    if (isalpha(first))
+    {
+        while (++this->current != this->end && isalnum((unsigned char)*this->current))
+            ;
+        lexeme.text = llvm::StringRef(start, this->current - start);
+        lexeme.kind = getKeyword(lexeme.text);
     }
-    else if (lastChar == '#')
+    else if (isdigit(first) || first == '.')
     {
+        bool isDot = false;
         do
-            lastChar = getchar();
-        while (lastChar != EOF || lastChar != '\n' || lastChar != '\r');
+        {
+            if (*this->current == '.')
+                isDot = true;
+            this->current++;
+        } while (this->current != this->end &&
+                 (isdigit((unsigned char)*this->current) || (*this->current == '.' && !isDot)));
 
-        if (lastChar != EOF)
-            return getToken();
+        lexeme.text = llvm::StringRef(start, this->current - start);
+        llvm::SmallString<32> numStr(lexeme.text);
+        lexeme.number = strtod(numStr.c_str(), 0);
+        lexeme.kind = tok_number;
     }
-    else if (lastChar == EOF)
-        return tok_eof;
+    else
+    {
+        lexeme.text = llvm::StringRef(start, 1);
+        lexeme.kind = first;
+        this->current++;
+    }
+
+    return this->lastLexeme = lexeme;
+}
+
+int getToken()
+{
+    if (!lexer)
+        lexer = make_unique<Lexer>();
+
+    const Lexeme &lexeme = lexer->next();
+
+    if (lexeme.kind == tok_number)
+        numVal = lexeme.number;
 
-    int thisChar = lastChar;
-    lastChar = getchar();
-    return thisChar;
-}
\ No newline at end of file
+    return lexeme.kind;
+}
@@ -1,3 +1,8 @@
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <cstdint>
+#include <memory>
+
 enum Token
 {
     tok_eof = -1,
@@ -8,7 +13,60 @@ enum Token
     tok_then = -7,
     tok_else = -8,
     tok_for = -9,
-    tok_in = -10
+    tok_in = -10,
+    tok_memo = -11,
+    tok_var = -12,
+    tok_extern = -13
 };
 
-int getToken();
\ No newline at end of file
+struct SourceLocation
+{
+    unsigned line = 1;
+    unsigned column = 1;
+};
+
+struct Lexeme
+{
+    int kind = tok_eof;
+    llvm::StringRef text;
+    double number = 0;
+    SourceLocation location;
+};
+
+// Splits source text into lexemes. A lexeme's text points into the lexer's
+// buffer and stays valid until the next call to next().
+class Lexer
+{
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    char *lineBuffer = nullptr;
+    size_t lineCapacity = 0;
+
+    const char *current = nullptr;
+    const char *end = nullptr;
+    const char *lineStart = nullptr;
+    unsigned line = 1;
+    uint64_t bytesRead = 0;
+
+    Lexeme lastLexeme;
+
+    bool refill();
+
+public:
+    // Reads stdin one line at a time, so the REPL still answers every line.
+    Lexer() {}
+    // Lexes a whole buffer, e.g. a memory-mapped file.
+    explicit Lexer(std::unique_ptr<llvm::MemoryBuffer> buffer);
+    ~Lexer();
+
+    static std::unique_ptr<Lexer> createForFile(llvm::StringRef path);
+
+    Lexeme next();
+    const Lexeme &last() const { return this->lastLexeme; }
+    uint64_t getBytesRead() const { return this->bytesRead; }
+    // The file being lexed, or <stdin>.
+    llvm::StringRef getSourceName() const { return this->buffer ? this->buffer->getBufferIdentifier() : "<stdin>"; }
+};
+
+extern thread_local std::unique_ptr<Lexer> lexer;
+
+int getToken();
@@ -1,49 +1,249 @@
 #include "Parser.h"
 #include "Lexer.h"
 #include "Common.h"
+#include "Interpreter.h"
+#include "Compiler.h"
+#include "Profile.h"
+#include "Batch.h"
+#include "Apply.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Function.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Timer.h"
+#include <chrono>
+#include <thread>
 
-llvm::ExitOnError exitOnError;
+static llvm::cl::OptionCategory bandCategory("Band options");
+
+static llvm::cl::opt<std::string> inputFile(llvm::cl::Positional, llvm::cl::desc("[input file]"),
+                                             llvm::cl::init(""), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<char> optLevel("O", llvm::cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O2')"),
+                                    llvm::cl::Prefix, llvm::cl::init('2'), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<bool, true> timePhasesOpt("time-phases", llvm::cl::desc("Report the time spent in each compile phase on exit"),
+                                               llvm::cl::location(timePhases), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<bool> timePhasesJSON("time-phases-json", llvm::cl::desc("Report --time-phases as JSON"),
+                                          llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<bool> lazyMode("lazy", llvm::cl::desc("Compile each definition on its first call instead of when it is first referenced"),
+                                    llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<unsigned> compileThreads("compile-threads", llvm::cl::desc("Compile each definition in the background on this many threads (default = 0, compile on first use)"),
+                                              llvm::cl::init(0), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<std::string> cacheDir("cache-dir", llvm::cl::desc("Reuse compiled objects for unchanged definitions from this directory"),
+                                            llvm::cl::value_desc("directory"), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<std::string> compileInput("c", llvm::cl::desc("Compile every definition in a file ahead of time instead of starting the REPL"),
+                                                llvm::cl::value_desc("input"), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<std::string> outputFile("o", llvm::cl::desc("Output file for -c (a C header is written next to it)"),
+                                              llvm::cl::value_desc("output"), llvm::cl::init("a.o"), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<bool> sharedLibrary("shared", llvm::cl::desc("With -c, link the output into a shared library"),
+                                         llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<std::string> batchInput("batch", llvm::cl::desc("Run a file without the REPL, parsing, generating IR and compiling in a pipeline"),
+                                              llvm::cl::value_desc("file"), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<unsigned> codegenThreads("codegen-threads", llvm::cl::desc("IR generation threads for --batch (default = 1)"),
+                                              llvm::cl::init(1), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<std::string> applySource("apply", llvm::cl::desc("Compile these definitions and evaluate the last one over every row of --input"),
+                                               llvm::cl::value_desc("definitions"), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<std::string> applyInput("input", llvm::cl::desc("Input of --apply: CSV text if it ends in .csv, otherwise binary columns of doubles"),
+                                              llvm::cl::value_desc("file"), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<std::string> applyColumns("columns", llvm::cl::desc("Names of the --input columns in order, e.g. a,b"),
+                                                llvm::cl::value_desc("names"), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<std::string> applyOutput("output", llvm::cl::desc("Output of --apply, CSV text or binary doubles like --input (default = 'out.bin')"),
+                                               llvm::cl::value_desc("file"), llvm::cl::init("out.bin"), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<unsigned> chunkRows("chunk-rows", llvm::cl::desc("Rows --apply evaluates at a time (default = 65536)"),
+                                         llvm::cl::init(65536), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<unsigned> applyThreads("apply-threads", llvm::cl::desc("Threads --apply evaluates on (default = all cores)"),
+                                            llvm::cl::init(std::thread::hardware_concurrency()), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<band::Reduction> reduction("reduce", llvm::cl::desc("Print a reduction of the --apply results instead of writing them"),
+                                                llvm::cl::values(clEnumValN(band::Reduction::Sum, "sum", "Their sum"),
+                                                                 clEnumValN(band::Reduction::Min, "min", "Their minimum"),
+                                                                 clEnumValN(band::Reduction::Max, "max", "Their maximum")),
+                                                llvm::cl::init(band::Reduction::None), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<bool> perfEvents("perf", llvm::cl::desc("Report JIT'd code with line info to perf, in a jitdump file and /tmp/perf-<pid>.map"),
+                                    llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<bool> gdbEvents("gdb", llvm::cl::desc("Register JIT'd code with line info with GDB's JIT interface"),
+                                     llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<bool> runtimeDyld("rtdyld", llvm::cl::desc("Link with RuntimeDyld and a memory manager per object instead of JITLink"),
+                                       llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<bool> printIR("print-ir", llvm::cl::desc("Print the IR of every definition"),
+                                   llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<bool, true> memoStatisticsOpt("memo-stats", llvm::cl::desc("Count the cache hits and misses of memo defs"),
+                                                   llvm::cl::location(memoStatistics), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<bool> lexOnly("lex-only", llvm::cl::desc("Only split the input into tokens and report the lexing throughput"),
+                                   llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<bool> tieredMode("tiered", llvm::cl::desc("Interpret functions and expressions, compiling hot functions in the background"),
+                                      llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<unsigned> tierThreshold("tier-threshold", llvm::cl::desc("Calls plus loop iterations before a function is compiled in --tiered mode"),
+                                             llvm::cl::init(1000), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<std::string> profileGenerate("profile-generate", llvm::cl::desc("Count calls and branches of every definition and write them to this file on exit"),
+                                                  llvm::cl::value_desc("file"), llvm::cl::cat(bandCategory));
+
+static llvm::cl::opt<std::string> profileUse("profile-use", llvm::cl::desc("Optimize definitions for the counts in this profile"),
+                                             llvm::cl::value_desc("file"), llvm::cl::cat(bandCategory));
 
 void handleDefinition()
 {
-    if (auto funcAST = parseDefinition())
+    shared_ptr<FunctionExpressionAST> funcAST;
     {
-        if (auto *funcIR = funcAST->codegen())
+        StageTimer timer(CompileStage::Parse);
+        funcAST = parseDefinition();
+        if (funcAST)
+            timer.setFunction(funcAST->getPrototype().getName());
+    }
+
+    if (funcAST)
+    {
+        unsigned name = funcAST->getPrototype().getNameId();
+        if (!declareFunction(funcAST->getPrototype(), funcAST))
         {
-            printf("Read function definition: ");
-            funcIR->print(errs());
-            printf("\n");
+            logError("Function can not be redefine");
+            return;
+        }
+
+        if (tieredMode)
+        {
+            printf("Read function definition: %s\n", symbols.getName(name).str().c_str());
+            addTieredFunction(std::move(funcAST));
+        }
+        else if (auto *funcIR = funcAST->codegen())
+        {
+            printf("Read function definition: %s\n", symbols.getName(name).str().c_str());
+            if (printIR)
+                funcIR->print(errs());
+            createMapEntry(funcIR);
+
+            auto threadSafeModule = takeCurrentModule();
+            if (lazyMode)
+                exitOnError(myJIT->addLazyModule(std::move(threadSafeModule)));
+            else
+                exitOnError(myJIT->addModule(std::move(threadSafeModule)));
+            initialModulesAndPassManager();
+
+            if (compileThreads > 0 && !lazyMode)
+                myJIT->compileAhead(symbols.getName(name));
         }
+        else
+            forgetFunction(name);
     }
-    else
+    // A definition rejected after its body stops at the ';' mainLoop skips.
+    else if (curToken != ';')
         getNextToken();
 }
 
+void handleExtern()
+{
+    auto prototype = parseExtern();
+    if (!prototype)
+    {
+        getNextToken();
+        return;
+    }
+
+    if (!declareFunction(*prototype))
+    {
+        logError("Function can not be redefine");
+        return;
+    }
+    printf("Read extern: %s\n", prototype->getName().str().c_str());
+}
+
 void handleTopLevelExpression()
 {
-    if (auto topLevelExp = parseTopLevelExpression())
+    unique_ptr<FunctionExpressionAST> topLevelExp;
+    {
+        llvm::NamedRegionTimer timer("parse", "Parsing", "band", "Band compile phases", timePhases);
+        topLevelExp = parseTopLevelExpression();
+    }
+
+    if (topLevelExp && tieredMode)
+    {
+        double result;
+        bool evaluated;
+        {
+            llvm::NamedRegionTimer timer("interpret", "Interpretation", "band", "Band compile phases", timePhases);
+            evaluated = evaluateTopLevel(*topLevelExp, result);
+        }
+        if (evaluated)
+            fprintf(stderr, "Evaluated to %f\n", result);
+    }
+    else if (topLevelExp)
     {
         if (auto *topLevelIR = topLevelExp->codegen())
         {
             auto runtime = myJIT->getMainJITDylib().createResourceTracker();
 
-            auto threadSafeModule = llvm::orc::ThreadSafeModule(std::move(module), std::move(ctx));
-            exitOnError(myJIT->addModule(std::move(threadSafeModule), runtime));
-            initialModulesAndPassManager();
+            llvm::Expected<llvm::JITEvaluatedSymbol> exprSymbol = llvm::JITEvaluatedSymbol();
+            {
+                llvm::NamedRegionTimer timer("jit", "Machine code generation and linking", "band", "Band compile phases", timePhases);
+                auto threadSafeModule = takeCurrentModule();
+                exitOnError(myJIT->addModule(std::move(threadSafeModule), runtime));
+                initialModulesAndPassManager();
 
-            auto exprSymbol = exitOnError(myJIT->lookup("__anon_expr"));
+                exprSymbol = myJIT->lookup("__anon_expr");
+            }
 
-            double (*FP)() = (double (*)())(intptr_t)exprSymbol.getAddress();
-            fprintf(stderr, "Evaluated to %f\n", FP());
+            // Linking fails if the expression, or a definition compiled for
+            // it, calls a symbol the JIT can not resolve; the REPL goes on.
+            if (!exprSymbol)
+            {
+                logAllUnhandledErrors(exprSymbol.takeError(), errs(), "Error: ");
+                exitOnError(myJIT->removeModule(runtime));
+                return;
+            }
 
-            exitOnError(runtime->remove());
+            double (*FP)() = (double (*)())(intptr_t)exprSymbol->getAddress();
+            double result;
+            {
+                llvm::NamedRegionTimer timer("run", "Execution", "band", "Band compile phases", timePhases);
+                result = FP();
+            }
+            fprintf(stderr, "Evaluated to %f\n", result);
+
+            exitOnError(myJIT->removeModule(runtime));
         }
     }
     else
         getNextToken();
 }
 
+int lexInput()
+{
+    auto start = std::chrono::steady_clock::now();
+    uint64_t tokens = 0;
+    while (getToken() != tok_eof)
+        tokens++;
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    double megabytes = lexer->getBytesRead() / 1e6;
+    fprintf(stderr, "Lexed %llu tokens, %.2f MB in %.3f s: %.1f MB/s\n", (unsigned long long)tokens,
+            megabytes, elapsed.count(), megabytes / elapsed.count());
+    return 0;
+}
+
 void mainLoop()
 {
     while (true)
@@ -55,8 +255,12 @@ void mainLoop()
         case ';':
             break;
         case tok_def:
+        case tok_memo:
             handleDefinition();
             break;
+        case tok_extern:
+            handleExtern();
+            break;
         default:
             handleTopLevelExpression();
             break;
@@ -66,19 +270,137 @@ void mainLoop()
     }
 }
 
-int main()
+// Creates the JIT with the listeners the options ask for. The listeners
+// need RuntimeDyld, so --perf and --gdb imply --rtdyld.
+static std::unique_ptr<llvm::orc::HadiJIT> createJIT(unsigned poolThreads)
+{
+    bool useRuntimeDyld = runtimeDyld || perfEvents || gdbEvents;
+    auto jit = exitOnError(llvm::orc::HadiJIT::Create(getCodeGenOptLevel(), poolThreads, cacheDir, useRuntimeDyld));
+    if (perfEvents || gdbEvents)
+        jit->enableEventListeners(perfEvents, gdbEvents);
+    return jit;
+}
+
+static void printReports()
 {
+    if (timePhases && timePhasesJSON)
+    {
+        errs() << "{";
+        llvm::TimerGroup::printAllJSONValues(errs(), "\n");
+        errs() << "\n}\n";
+    }
+    else if (timePhases)
+        llvm::TimerGroup::printAll(errs());
+    if (collectStats)
+        printStats(errs());
+}
+
+int main(int argc, char **argv)
+{
+    // LLVM registers -stats for pass statistics, which release builds do not
+    // collect; Band reports its own under that name.
+    auto &options = llvm::cl::getRegisteredOptions();
+    auto statsOption = options.find("stats");
+    if (statsOption != options.end())
+    {
+        statsOption->second->addCategory(bandCategory);
+        statsOption->second->setDescription("Report each definition's compile time per stage, code size and calls on exit");
+    }
+    llvm::cl::HideUnrelatedOptions(bandCategory);
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Band language JIT\n");
+    collectStats = llvm::AreStatisticsEnabled();
+    debugInfo = perfEvents || gdbEvents;
+
+    if (optLevel < '0' || optLevel > '3')
+    {
+        fprintf(stderr, "Invalid optimization level -O%c\n", optLevel.getValue());
+        return 1;
+    }
+    optimizationLevel = optLevel - '0';
+
     initializeNativeTargets();
     initialBinOpPrecs();
 
+    if (!inputFile.empty())
+    {
+        lexer = Lexer::createForFile(inputFile);
+        if (!lexer)
+            return 1;
+    }
+
+    if (lexOnly)
+        return lexInput();
+
+    if (!profileUse.empty() && !loadProfile(profileUse))
+        return 1;
+    profileGeneration = !profileGenerate.empty();
+
+    if (!compileInput.empty())
+    {
+        // Instrumented code points at this process's counters.
+        if (profileGeneration)
+        {
+            fprintf(stderr, "--profile-generate needs the JIT, it can not be used with -c\n");
+            return 1;
+        }
+        int status = compileFile(compileInput, outputFile, sharedLibrary);
+        printReports();
+        return status;
+    }
+
+    if (!applySource.empty())
+    {
+        if (applyInput.empty() || chunkRows == 0)
+        {
+            fprintf(stderr, "--apply needs an --input and a --chunk-rows above 0\n");
+            return 1;
+        }
+        myJIT = createJIT(compileThreads);
+        initialModulesAndPassManager();
+        int status = runApply(applySource, applyInput, applyColumns, applyOutput, chunkRows, applyThreads, reduction);
+        if (profileGeneration && !writeProfile(profileGenerate))
+            return 1;
+        printReports();
+        return status;
+    }
+
+    if (!batchInput.empty())
+    {
+        if (tieredMode)
+        {
+            fprintf(stderr, "--batch always compiles, it can not be used with --tiered\n");
+            return 1;
+        }
+        // Phase timers are not thread safe; the batch summary times the stages instead.
+        timePhases = false;
+        unsigned poolThreads = compileThreads ? compileThreads : std::thread::hardware_concurrency();
+        myJIT = createJIT(lazyMode ? 0 : poolThreads);
+        int status = runBatch(batchInput, codegenThreads, lazyMode, printIR);
+        if (profileGeneration && !writeProfile(profileGenerate))
+            return 1;
+        printReports();
+        return status;
+    }
+
     printf("ready> ");
     getNextToken();
 
-    myJIT = exitOnError(llvm::orc::HadiJIT::Create());
+    myJIT = createJIT(compileThreads);
 
     initialModulesAndPassManager();
 
+    if (tieredMode)
+        initialTieredRuntime(tierThreshold);
+
     mainLoop();
 
+    if (tieredMode)
+        shutdownTieredRuntime();
+
+    if (profileGeneration && !writeProfile(profileGenerate))
+        return 1;
+
+    printReports();
+
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,275 @@
+#include "Parallel.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Process.h"
+#include <algorithm>
+#include <limits>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+using namespace llvm;
+
+ParallelRunner::ParallelRunner(unsigned threadCount)
+{
+    threadCount = std::max(threadCount, 1u);
+    this->ranges.reset(new WorkerRange[threadCount]);
+
+    std::vector<unsigned> cpus;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed))
+                cpus.push_back(cpu);
+
+    for (unsigned worker = 1; worker < threadCount; worker++)
+    {
+        this->threads.emplace_back(&ParallelRunner::workerLoop, this, worker);
+        if (cpus.size() > 1)
+        {
+            cpu_set_t pinned;
+            CPU_ZERO(&pinned);
+            CPU_SET(cpus[worker % cpus.size()], &pinned);
+            pthread_setaffinity_np(this->threads.back().native_handle(), sizeof(pinned), &pinned);
+        }
+    }
+}
+
+ParallelRunner::~ParallelRunner()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->started.notify_all();
+    for (auto &thread : this->threads)
+        thread.join();
+}
+
+void ParallelRunner::run(uint64_t chunks, function_ref<void(unsigned, uint64_t)> work, bool steal)
+{
+    if (chunks == 0)
+        return;
+
+    std::lock_guard<std::mutex> runLock(this->runMutex);
+    unsigned count = this->getThreadCount();
+    for (unsigned worker = 0; worker < count; worker++)
+    {
+        std::lock_guard<std::mutex> lock(this->ranges[worker].mutex);
+        this->ranges[worker].next = chunks * worker / count;
+        this->ranges[worker].end = chunks * (worker + 1) / count;
+    }
+    this->work = work;
+    this->steal = steal;
+
+    if (!this->threads.empty())
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->generation++;
+            this->running = this->threads.size();
+        }
+        this->started.notify_all();
+    }
+
+    this->runShare(0);
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->finished.wait(lock, [this]
+                        { return this->running == 0; });
+}
+
+void ParallelRunner::workerLoop(unsigned worker)
+{
+    uint64_t seen = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->started.wait(lock, [&]
+                               { return this->stopping || this->generation != seen; });
+            if (this->stopping)
+                return;
+            seen = this->generation;
+        }
+
+        this->runShare(worker);
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (--this->running == 0)
+            this->finished.notify_one();
+    }
+}
+
+void ParallelRunner::runShare(unsigned worker)
+{
+    uint64_t chunk;
+    do
+    {
+        while (this->takeChunk(worker, chunk))
+            this->work(worker, chunk);
+    } while (this->steal && this->stealChunks(worker));
+}
+
+bool ParallelRunner::takeChunk(unsigned worker, uint64_t &chunk)
+{
+    WorkerRange &range = this->ranges[worker];
+    std::lock_guard<std::mutex> lock(range.mutex);
+    if (range.next == range.end)
+        return false;
+    chunk = range.next++;
+    return true;
+}
+
+// Moves the back half of the first non-empty share after this worker's own
+// into it. A chunk is never in two shares, so no chunk runs twice.
+bool ParallelRunner::stealChunks(unsigned worker)
+{
+    unsigned count = this->getThreadCount();
+    for (unsigned offset = 1; offset < count; offset++)
+    {
+        WorkerRange &victim = this->ranges[(worker + offset) % count];
+        uint64_t first, last;
+        {
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            uint64_t left = victim.end - victim.next;
+            if (left == 0)
+                continue;
+            last = victim.end;
+            victim.end -= (left + 1) / 2;
+            first = victim.end;
+        }
+
+        WorkerRange &range = this->ranges[worker];
+        std::lock_guard<std::mutex> lock(range.mutex);
+        range.next = first;
+        range.end = last;
+        return true;
+    }
+    return false;
+}
+
+double getReductionIdentity(band::Reduction reduction)
+{
+    switch (reduction)
+    {
+    case band::Reduction::Min:
+        return std::numeric_limits<double>::infinity();
+    case band::Reduction::Max:
+        return -std::numeric_limits<double>::infinity();
+    default:
+        return 0;
+    }
+}
+
+struct SumOf
+{
+    double operator()(double a, double b) const { return a + b; }
+};
+
+struct MinOf
+{
+    double operator()(double a, double b) const { return b < a ? b : a; }
+};
+
+struct MaxOf
+{
+    double operator()(double a, double b) const { return b > a ? b : a; }
+};
+
+// Four running values let consecutive additions or comparisons overlap.
+template <typename Combine>
+static double reduceChunk(const double *values, uint64_t count, double identity, Combine combine)
+{
+    double lanes[4] = {identity, identity, identity, identity};
+    uint64_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        for (unsigned lane = 0; lane < 4; lane++)
+            lanes[lane] = combine(lanes[lane], values[i + lane]);
+    for (; i < count; i++)
+        lanes[0] = combine(lanes[0], values[i]);
+    return combine(combine(lanes[0], lanes[1]), combine(lanes[2], lanes[3]));
+}
+
+static double reduceChunk(band::Reduction reduction, const double *values, uint64_t count)
+{
+    double identity = getReductionIdentity(reduction);
+    switch (reduction)
+    {
+    case band::Reduction::Min:
+        return reduceChunk(values, count, identity, MinOf());
+    case band::Reduction::Max:
+        return reduceChunk(values, count, identity, MaxOf());
+    default:
+        return reduceChunk(values, count, identity, SumOf());
+    }
+}
+
+static double combineReduction(band::Reduction reduction, double a, double b)
+{
+    switch (reduction)
+    {
+    case band::Reduction::Min:
+        return MinOf()(a, b);
+    case band::Reduction::Max:
+        return MaxOf()(a, b);
+    default:
+        return SumOf()(a, b);
+    }
+}
+
+void mapRows(ParallelRunner &runner, band::ColumnMapFunction map, ArrayRef<const double *> columns, double *out,
+             uint64_t rows, uint64_t chunkRows, band::Reduction reduction, double &accumulator)
+{
+    uint64_t chunks = (rows + chunkRows - 1) / chunkRows;
+    bool reducing = reduction != band::Reduction::None;
+    std::vector<double> partials(reducing ? chunks : 0);
+    // Without an output, each worker evaluates into a buffer of its own.
+    std::vector<std::vector<double>> scratch(out ? 0 : runner.getThreadCount());
+
+    runner.run(chunks, [&](unsigned worker, uint64_t chunk)
+               {
+        uint64_t first = chunk * chunkRows;
+        uint64_t count = std::min(chunkRows, rows - first);
+        SmallVector<const double *, 8> chunkColumns;
+        for (const double *column : columns)
+            chunkColumns.push_back(column + first);
+
+        double *results = out ? out + first : nullptr;
+        if (!results)
+        {
+            scratch[worker].resize(chunkRows);
+            results = scratch[worker].data();
+        }
+        map(chunkColumns.data(), results, count);
+        if (reducing)
+            partials[chunk] = reduceChunk(reduction, results, count); });
+
+    for (double partial : partials)
+        accumulator = combineReduction(reduction, accumulator, partial);
+}
+
+double *allocateRows(ParallelRunner &runner, uint64_t rows, uint64_t chunkRows)
+{
+    if (rows == 0)
+        return nullptr;
+    void *memory = mmap(nullptr, rows * sizeof(double), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return nullptr;
+
+    // Touch every page from the worker that owns it when nothing is stolen.
+    double *data = static_cast<double *>(memory);
+    uint64_t pageRows = sys::Process::getPageSizeEstimate() / sizeof(double);
+    runner.run((rows + chunkRows - 1) / chunkRows, [&](unsigned, uint64_t chunk)
+               {
+        uint64_t first = chunk * chunkRows;
+        uint64_t last = std::min(first + chunkRows, rows);
+        for (uint64_t row = first; row < last; row += pageRows)
+            data[row] = 0; },
+               false);
+    return data;
+}
+
+void freeRows(double *rows, uint64_t count)
+{
+    if (rows)
+        munmap(rows, count * sizeof(double));
+}
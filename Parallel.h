@@ -0,0 +1,68 @@
+#include "Band.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs chunks of work on a fixed set of threads. The calling thread is
+// worker 0. Every worker starts on its own contiguous share of the chunks;
+// a worker that runs out steals the back half of another worker's share.
+// Worker threads are pinned to CPUs, so memory a worker touches first stays
+// on its NUMA node.
+class ParallelRunner
+{
+    // Padded so the ranges of neighbouring workers never share a cache line.
+    struct WorkerRange
+    {
+        std::mutex mutex;
+        uint64_t next = 0;
+        uint64_t end = 0;
+        char padding[64];
+    };
+
+    std::vector<std::thread> threads;
+    std::unique_ptr<WorkerRange[]> ranges;
+    llvm::function_ref<void(unsigned, uint64_t)> work;
+    bool steal = true;
+
+    std::mutex runMutex;
+    std::mutex mutex;
+    std::condition_variable started, finished;
+    uint64_t generation = 0;
+    unsigned running = 0;
+    bool stopping = false;
+
+    void workerLoop(unsigned worker);
+    void runShare(unsigned worker);
+    bool takeChunk(unsigned worker, uint64_t &chunk);
+    bool stealChunks(unsigned worker);
+
+public:
+    explicit ParallelRunner(unsigned threadCount);
+    ~ParallelRunner();
+
+    unsigned getThreadCount() const { return this->threads.size() + 1; }
+
+    // Calls work(worker, chunk) once for every chunk below chunks and
+    // returns when all calls have. Without steal, each worker runs exactly
+    // its own share. Calls from several threads run one after the other.
+    void run(uint64_t chunks, llvm::function_ref<void(unsigned, uint64_t)> work, bool steal = true);
+};
+
+double getReductionIdentity(band::Reduction reduction);
+
+// Evaluates map over rows of columns, chunkRows rows per chunk, on all of
+// runner's threads. Results go to out unless it is null. With a reduction,
+// the reduction of each chunk is folded into accumulator in chunk order, so
+// the result only depends on chunkRows, not on the threads.
+void mapRows(ParallelRunner &runner, band::ColumnMapFunction map, llvm::ArrayRef<const double *> columns,
+             double *out, uint64_t rows, uint64_t chunkRows, band::Reduction reduction, double &accumulator);
+
+// Allocates the output of mapRows with the same runner and chunkRows. Each
+// page is first touched by the worker whose share it is in, so it is
+// placed on that worker's NUMA node. Free it with freeRows.
+double *allocateRows(ParallelRunner &runner, uint64_t rows, uint64_t chunkRows);
+void freeRows(double *rows, uint64_t count);
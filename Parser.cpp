@@ -1,19 +1,32 @@
 #include "Parser.h"
 #include "Lexer.h"
 #include "Common.h"
+#include "llvm/ADT/SmallVector.h"
 #include <map>
 
-int curToken;
+thread_local int curToken;
 static map<char, int> binOperatorPrecedence;
+static thread_local ASTArena *astArena;
+
+template <typename NodeT, typename... ArgsT>
+static NodeT *makeNode(ArgsT &&...args)
+{
+    return new (*astArena) NodeT(std::forward<ArgsT>(args)...);
+}
+
+static unsigned internIdentifier()
+{
+    return symbols.intern(lexer->last().text);
+}
 
 int getNextToken()
 {
     curToken = getToken();
-    // printf("%i %s\n", curToken, identifierStr.c_str()); // For debug
+    // printf("%i %s\n", curToken, lexer->last().text.str().c_str()); // For debug
     return curToken;
 }
 
-unique_ptr<ExpressionAST> logError(const char *errorStr)
+ExpressionAST *logError(const char *errorStr)
 {
     printf("Error: %s\n", errorStr);
     return nullptr;
@@ -25,14 +38,35 @@ unique_ptr<PrototypeAST> logErrorProto(const char *errorStr)
     return nullptr;
 }
 
-unique_ptr<ExpressionAST> parseNumberExpr()
+// Parses the type after a ':', as in a:f32.
+static bool parseTypeAnnotation(ValueType &type)
+{
+    if (getNextToken() != tok_identifier || !findValueType(lexer->last().text, type))
+    {
+        logError("Expected a type: f64, f32 or i64");
+        return false;
+    }
+    getNextToken();
+    return true;
+}
+
+// Wraps value, or 0 if there is none, in the conversion to type, so a typed
+// local starts out with its type and the AST needs no type fields.
+static ExpressionAST *makeConversion(ValueType type, ExpressionAST *value, unsigned line)
 {
-    auto result = make_unique<NumberExpAST>(numVal);
+    ExpressionAST **argArray = astArena->Allocate<ExpressionAST *>(1);
+    argArray[0] = value ? value : makeNode<NumberExpAST>(0.0);
+    return makeNode<CallExpressionAST>(symbols.intern(getValueTypeName(type)), makeMutableArrayRef(argArray, 1), line);
+}
+
+ExpressionAST *parseNumberExpr()
+{
+    auto result = makeNode<NumberExpAST>(numVal);
     getNextToken();
-    return move(result);
+    return result;
 }
 
-unique_ptr<ExpressionAST> parseParenthesesExpr()
+ExpressionAST *parseParenthesesExpr()
 {
     getNextToken();
     auto value = parseExpression();
@@ -46,23 +80,24 @@ unique_ptr<ExpressionAST> parseParenthesesExpr()
     return value;
 }
 
-unique_ptr<ExpressionAST> parseIdentifierExpr()
+ExpressionAST *parseIdentifierExpr()
 {
-    string nameId = identifierStr;
+    unsigned line = lexer->last().location.line;
+    unsigned nameId = internIdentifier();
     getNextToken();
 
     if (curToken != '(')
-        return make_unique<VariableExpAST>(nameId);
+        return makeNode<VariableExpAST>(nameId);
 
     getNextToken();
-    vector<unique_ptr<ExpressionAST>> args;
+    SmallVector<ExpressionAST *, 4> args;
 
     if (curToken != ')')
     {
         while (true)
         {
             if (auto arg = parseExpression())
-                args.push_back(move(arg));
+                args.push_back(arg);
             else
                 return nullptr;
 
@@ -77,10 +112,12 @@ unique_ptr<ExpressionAST> parseIdentifierExpr()
 
     getNextToken();
 
-    return make_unique<CallExpressionAST>(nameId, move(args));
+    ExpressionAST **argArray = astArena->Allocate<ExpressionAST *>(args.size());
+    std::copy(args.begin(), args.end(), argArray);
+    return makeNode<CallExpressionAST>(nameId, makeMutableArrayRef(argArray, args.size()), line);
 }
 
-unique_ptr<ExpressionAST> parsePrimary()
+ExpressionAST *parsePrimary()
 {
     switch (curToken)
     {
@@ -94,6 +131,8 @@ unique_ptr<ExpressionAST> parsePrimary()
         return parseIfExpresion();
     case tok_for:
         return parseForExpresion();
+    case tok_var:
+        return parseVarExpression();
     default:
         return logError("Unknown token");
     }
@@ -104,22 +143,25 @@ int getTokPrecedence()
     if (!isascii(curToken))
         return -1;
 
-    int tokPrec = binOperatorPrecedence[curToken];
-    if (tokPrec < 0)
+    // The table is shared by every thread's parser, so it must not grow here.
+    auto precIter = binOperatorPrecedence.find(curToken);
+    if (precIter == binOperatorPrecedence.end() || precIter->second < 0)
         return -1;
 
-    return tokPrec;
+    return precIter->second;
 }
 
 void initialBinOpPrecs()
 {
+    binOperatorPrecedence[':'] = 1;
+    binOperatorPrecedence['='] = 2;
     binOperatorPrecedence['<'] = 10;
     binOperatorPrecedence['-'] = 20;
     binOperatorPrecedence['+'] = 20;
     binOperatorPrecedence['*'] = 40;
 }
 
-unique_ptr<ExpressionAST> parseBinaryOpRHS(int opCodePrec, unique_ptr<ExpressionAST> lhs)
+ExpressionAST *parseBinaryOpRHS(int opCodePrec, ExpressionAST *lhs)
 {
     while (true)
     {
@@ -129,31 +171,41 @@ unique_ptr<ExpressionAST> parseBinaryOpRHS(int opCodePrec, unique_ptr<Expression
             return lhs;
 
         int binOp = curToken;
+        unsigned line = lexer->last().location.line;
         getNextToken();
 
         auto rhs = parsePrimary();
         if (!rhs)
             return nullptr;
 
+        // '=' is right associative, so a = b = c assigns c to both.
         int nextPrec = getTokPrecedence();
         if (tokPrec <= nextPrec)
         {
-            rhs = parseBinaryOpRHS(tokPrec + 1, move(rhs));
+            rhs = parseBinaryOpRHS(binOp == '=' ? tokPrec - 1 : tokPrec + 1, rhs);
             if (!rhs)
                 return nullptr;
         }
 
-        lhs = make_unique<BinaryExpAST>(binOp, move(lhs), move(rhs));
+        if (binOp == '=')
+        {
+            int name = lhs->getVariableName();
+            if (name < 0)
+                return logError("Expected a variable on the left of '='");
+            lhs = makeNode<AssignExpAST>(name, rhs, line);
+        }
+        else
+            lhs = makeNode<BinaryExpAST>(binOp, lhs, rhs, line);
     }
 }
 
-unique_ptr<ExpressionAST> parseExpression()
+ExpressionAST *parseExpression()
 {
     auto lhs = parsePrimary();
     if (!lhs)
         return nullptr;
 
-    return parseBinaryOpRHS(0, move(lhs));
+    return parseBinaryOpRHS(0, lhs);
 }
 
 unique_ptr<PrototypeAST> parsePrototype()
@@ -161,49 +213,108 @@ unique_ptr<PrototypeAST> parsePrototype()
     if (curToken != tok_identifier)
         return logErrorProto("Expected Function name in ");
 
-    string funcName = identifierStr;
+    unsigned line = lexer->last().location.line;
+    unsigned funcName = internIdentifier();
     getNextToken();
 
     if (curToken != '(')
         return logErrorProto("Expected '(' in prototype");
 
-    vector<string> argNames;
-    while (getNextToken() == tok_identifier)
-        argNames.push_back(identifierStr);
+    vector<unsigned> argNames;
+    vector<ValueType> argTypes;
+    getNextToken();
+    while (curToken == tok_identifier)
+    {
+        argNames.push_back(internIdentifier());
+        ValueType type = ValueType::F64;
+        if (getNextToken() == ':' && !parseTypeAnnotation(type))
+            return nullptr;
+        argTypes.push_back(type);
+    }
     if (curToken != ')')
         return logErrorProto("Expected ')' in prototype");
 
     getNextToken();
 
-    return make_unique<PrototypeAST>(funcName, move(argNames));
+    ValueType returnType = ValueType::F64;
+    if (curToken == ':' && !parseTypeAnnotation(returnType))
+        return nullptr;
+
+    ValueType conversion;
+    if (findValueType(symbols.getName(funcName), conversion))
+        return logErrorProto("A type name can not be redefined");
+
+    auto prototype = make_unique<PrototypeAST>(funcName, move(argNames), move(argTypes));
+    prototype->setReturnType(returnType);
+    prototype->setLine(line);
+    return prototype;
 }
 
 unique_ptr<FunctionExpressionAST> parseDefinition()
 {
+    bool memoized = curToken == tok_memo;
+    if (memoized && getNextToken() != tok_def)
+    {
+        logError("Expected 'def' after 'memo'");
+        return nullptr;
+    }
     getNextToken();
 
     auto prototype = parsePrototype();
     if (!prototype)
         return nullptr;
+    prototype->setMemoized(memoized);
 
-    if (auto body = parseExpression())
-        return make_unique<FunctionExpressionAST>(move(prototype), move(body));
+    auto arena = make_unique<ASTArena>();
+    astArena = arena.get();
+    auto body = parseExpression();
+    // Checked once the body is consumed, so parsing resumes after it.
+    if (body && isLibraryFunction(*prototype))
+        logError("A definition can not reuse the name of a math builtin or C library function");
+    else if (body)
+        return make_unique<FunctionExpressionAST>(move(arena), move(prototype), body);
 
     return nullptr;
 }
 
+unique_ptr<PrototypeAST> parseExtern()
+{
+    getNextToken();
+
+    auto prototype = parsePrototype();
+    if (!prototype)
+        return nullptr;
+
+    int builtinArity = getBuiltinArity(prototype->getNameId());
+    if (builtinArity >= 0 && builtinArity != (int)prototype->getArgs().size())
+        return logErrorProto("Incorrect number of arguments for a math builtin");
+    // Builtins and the runtime table only exist for doubles.
+    if (prototype->isTyped())
+        return logErrorProto("An extern can only take and return f64");
+
+    prototype->setExtern(true);
+    return prototype;
+}
+
 unique_ptr<FunctionExpressionAST> parseTopLevelExpression()
 {
+    auto arena = make_unique<ASTArena>();
+    astArena = arena.get();
+    unsigned line = lexer->last().location.line;
     if (auto exp = parseExpression())
     {
-        auto prototype = make_unique<PrototypeAST>("__anon_expr", vector<string>());
-        return make_unique<FunctionExpressionAST>(move(prototype), move(exp));
+        static unsigned anonExprName = symbols.intern("__anon_expr");
+        auto prototype = make_unique<PrototypeAST>(anonExprName, vector<unsigned>());
+        prototype->setLine(line);
+        auto function = make_unique<FunctionExpressionAST>(move(arena), move(prototype), exp);
+        function->fold();
+        return function;
     }
 
     return nullptr;
 }
 
-unique_ptr<ExpressionAST> parseIfExpresion()
+ExpressionAST *parseIfExpresion()
 {
     getNextToken();
 
@@ -227,19 +338,25 @@ unique_ptr<ExpressionAST> parseIfExpresion()
     if (!elseStmt)
         return nullptr;
 
-    return make_unique<IfExpressionAST>(move(condition), move(thenStmt), move(elseStmt));
+    return makeNode<IfExpressionAST>(condition, thenStmt, elseStmt);
 }
 
-unique_ptr<ExpressionAST> parseForExpresion()
+ExpressionAST *parseForExpresion()
 {
+    unsigned line = lexer->last().location.line;
     getNextToken();
 
     if (curToken != tok_identifier)
         return logError("expected identifier after for");
 
-    string idName = identifierStr;
+    unsigned idName = internIdentifier();
     getNextToken();
 
+    ValueType type = ValueType::F64;
+    bool typed = curToken == ':';
+    if (typed && !parseTypeAnnotation(type))
+        return nullptr;
+
     if (curToken != '=')
         return logError("expected '='after identifier");
     getNextToken();
@@ -247,6 +364,8 @@ unique_ptr<ExpressionAST> parseForExpresion()
     auto start = parseExpression();
     if (!start)
         return nullptr;
+    if (typed)
+        start = makeConversion(type, start, line);
 
     if (curToken != ',')
         return logError("expected ',' after initialization");
@@ -256,7 +375,7 @@ unique_ptr<ExpressionAST> parseForExpresion()
     if (!end)
         return nullptr;
 
-    unique_ptr<ExpressionAST> step;
+    ExpressionAST *step = nullptr;
     if (curToken == ',')
     {
         getNextToken();
@@ -275,5 +394,58 @@ unique_ptr<ExpressionAST> parseForExpresion()
     if (!body)
         return nullptr;
 
-    return make_unique<ForExpressionAST>(idName, move(start), move(end), move(step), move(body));
-}
\ No newline at end of file
+    return makeNode<ForExpressionAST>(idName, start, end, step, body, line);
+}
+
+ExpressionAST *parseVarExpression()
+{
+    getNextToken();
+
+    if (curToken != tok_identifier)
+        return logError("expected identifier after var");
+
+    SmallVector<pair<unsigned, ExpressionAST *>, 4> vars;
+    while (true)
+    {
+        unsigned line = lexer->last().location.line;
+        unsigned name = internIdentifier();
+        getNextToken();
+
+        ValueType type = ValueType::F64;
+        bool typed = curToken == ':';
+        if (typed && !parseTypeAnnotation(type))
+            return nullptr;
+
+        ExpressionAST *init = nullptr;
+        if (curToken == '=')
+        {
+            getNextToken();
+
+            init = parseExpression();
+            if (!init)
+                return nullptr;
+        }
+        if (typed)
+            init = makeConversion(type, init, line);
+        vars.push_back({name, init});
+
+        if (curToken != ',')
+            break;
+        getNextToken();
+
+        if (curToken != tok_identifier)
+            return logError("expected identifier list after var");
+    }
+
+    if (curToken != tok_in)
+        return logError("expected 'in' keyword after 'var'");
+    getNextToken();
+
+    auto body = parseExpression();
+    if (!body)
+        return nullptr;
+
+    auto *varArray = astArena->Allocate<pair<unsigned, ExpressionAST *>>(vars.size());
+    std::uninitialized_copy(vars.begin(), vars.end(), varArray);
+    return makeNode<VarExpressionAST>(makeMutableArrayRef(varArray, vars.size()), body);
+}
@@ -2,20 +2,22 @@
 
 int getNextToken();
 
-unique_ptr<ExpressionAST> logError(const char *errorStr);
+ExpressionAST *logError(const char *errorStr);
 unique_ptr<PrototypeAST> logErrorProto(const char *errorStr);
 
-unique_ptr<ExpressionAST> parseNumberExpr();
-unique_ptr<ExpressionAST> parseParenthesesExpr();
-unique_ptr<ExpressionAST> parseIdentifierExpr();
-unique_ptr<ExpressionAST> parsePrimary();
-unique_ptr<ExpressionAST> parseExpression();
-unique_ptr<ExpressionAST> parseBinaryOpRHS(int opCode, unique_ptr<ExpressionAST> lhs);
+ExpressionAST *parseNumberExpr();
+ExpressionAST *parseParenthesesExpr();
+ExpressionAST *parseIdentifierExpr();
+ExpressionAST *parsePrimary();
+ExpressionAST *parseExpression();
+ExpressionAST *parseBinaryOpRHS(int opCode, ExpressionAST *lhs);
 unique_ptr<PrototypeAST> parsePrototype();
 unique_ptr<FunctionExpressionAST> parseDefinition();
+unique_ptr<PrototypeAST> parseExtern();
 unique_ptr<FunctionExpressionAST> parseTopLevelExpression();
-unique_ptr<ExpressionAST> parseIfExpresion();
-unique_ptr<ExpressionAST> parseForExpresion();
+ExpressionAST *parseIfExpresion();
+ExpressionAST *parseForExpresion();
+ExpressionAST *parseVarExpression();
 
 int getTokPrecedence();
 
@@ -0,0 +1,101 @@
+#include "Profile.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <deque>
+#include <mutex>
+
+using namespace llvm;
+
+bool profileGeneration = false;
+
+// A deque keeps the counters in place as sites are added.
+static StringMap<std::deque<BranchCounts>> generatedCounts;
+static std::mutex generatedCountsMutex;
+
+static StringMap<std::deque<BranchCounts>> loadedCounts;
+static uint64_t maxCalls = 0;
+
+BranchCounts *getProfileCounters(StringRef function, unsigned site)
+{
+    std::lock_guard<std::mutex> lock(generatedCountsMutex);
+    std::deque<BranchCounts> &counts = generatedCounts[function];
+    if (site >= counts.size())
+        counts.resize(site + 1);
+    return &counts[site];
+}
+
+const BranchCounts *findProfileCounts(StringRef function, unsigned site)
+{
+    auto countsIter = loadedCounts.find(function);
+    if (countsIter == loadedCounts.end() || site >= countsIter->second.size())
+        return nullptr;
+    return &countsIter->second[site];
+}
+
+uint64_t getProfileMaxCalls()
+{
+    return maxCalls;
+}
+
+// Each line is "<definition> <site> <taken> <not taken>".
+bool loadProfile(StringRef path)
+{
+    auto buffer = MemoryBuffer::getFile(path);
+    if (!buffer)
+    {
+        errs() << "Could not read profile " << path << ": " << buffer.getError().message() << "\n";
+        return false;
+    }
+
+    SmallVector<StringRef, 0> lines;
+    (*buffer)->getBuffer().split(lines, '\n', -1, false);
+    for (StringRef line : lines)
+    {
+        line = line.trim();
+        if (line.empty() || line.startswith("#"))
+            continue;
+
+        SmallVector<StringRef, 4> fields;
+        line.split(fields, ' ', -1, false);
+        unsigned site;
+        BranchCounts counts;
+        if (fields.size() != 4 || fields[1].getAsInteger(10, site) || fields[2].getAsInteger(10, counts.taken) ||
+            fields[3].getAsInteger(10, counts.notTaken))
+        {
+            errs() << "Malformed profile line in " << path << ": " << line << "\n";
+            return false;
+        }
+
+        std::deque<BranchCounts> &functionCounts = loadedCounts[fields[0]];
+        if (site >= functionCounts.size())
+            functionCounts.resize(site + 1);
+        functionCounts[site] = counts;
+        if (site == 0)
+            maxCalls = std::max(maxCalls, counts.taken);
+    }
+
+    return true;
+}
+
+bool writeProfile(StringRef path)
+{
+    std::error_code errorCode;
+    raw_fd_ostream out(path, errorCode, sys::fs::OF_Text);
+    if (errorCode)
+    {
+        errs() << "Could not write profile " << path << ": " << errorCode.message() << "\n";
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(generatedCountsMutex);
+    out << "# Band profile: <definition> <site> <taken> <not taken>\n";
+    for (auto &function : generatedCounts)
+    {
+        unsigned site = 0;
+        for (const BranchCounts &counts : function.second)
+            out << function.first() << " " << site++ << " " << counts.taken << " " << counts.notTaken << "\n";
+    }
+    return true;
+}
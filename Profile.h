@@ -0,0 +1,26 @@
+#include "llvm/ADT/StringRef.h"
+#include <cstdint>
+
+// Call and branch counts for profile-guided optimization, keyed on a
+// definition's name and a site number. Site 0 counts calls of the
+// definition; every if and for in its body takes the next site in IR
+// generation order, counting the then/continue edge and the else/exit edge.
+struct BranchCounts
+{
+    uint64_t taken = 0;
+    uint64_t notTaken = 0;
+};
+
+// When set, IR generation instruments every site of every definition.
+extern bool profileGeneration;
+
+// Returns the counters instrumented code increments for a site. They are
+// never freed, so JIT'd code can embed their address.
+BranchCounts *getProfileCounters(llvm::StringRef function, unsigned site);
+// Returns the counts loadProfile read for a site, or null.
+const BranchCounts *findProfileCounts(llvm::StringRef function, unsigned site);
+// The largest call count of any definition in the loaded profile.
+uint64_t getProfileMaxCalls();
+
+bool loadProfile(llvm::StringRef path);
+bool writeProfile(llvm::StringRef path);
@@ -0,0 +1,84 @@
+#include "Runtime.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+using namespace llvm;
+
+extern "C" double putchard(double character)
+{
+    fputc((char)character, stderr);
+    return 0;
+}
+
+extern "C" double printd(double value)
+{
+    fprintf(stderr, "%f\n", value);
+    return 0;
+}
+
+// LLVM lowers llvm.powi to this compiler-rt/libgcc helper.
+extern "C" double __powidf2(double, int);
+
+typedef double (*Unary)(double);
+typedef double (*Binary)(double, double);
+typedef double (*Ternary)(double, double, double);
+
+static void forEachRuntimeSymbol(function_ref<void(StringRef, const void *)> add)
+{
+    struct
+    {
+        const char *name;
+        Unary function;
+    } unary[] = {{"sqrt", ::sqrt}, {"sin", ::sin}, {"cos", ::cos}, {"tan", ::tan},
+                 {"asin", ::asin}, {"acos", ::acos}, {"atan", ::atan}, {"sinh", ::sinh},
+                 {"cosh", ::cosh}, {"tanh", ::tanh}, {"exp", ::exp}, {"exp2", ::exp2},
+                 {"expm1", ::expm1}, {"log", ::log}, {"log2", ::log2}, {"log10", ::log10},
+                 {"log1p", ::log1p}, {"cbrt", ::cbrt}, {"fabs", ::fabs}, {"floor", ::floor},
+                 {"ceil", ::ceil}, {"trunc", ::trunc}, {"round", ::round}, {"rint", ::rint},
+                 {"nearbyint", ::nearbyint}, {"roundeven", ::roundeven}, {"exp10", ::exp10},
+                 {"putchard", putchard}, {"printd", printd}};
+    for (auto &entry : unary)
+        add(entry.name, (const void *)entry.function);
+
+    struct
+    {
+        const char *name;
+        Binary function;
+    } binary[] = {{"pow", ::pow}, {"atan2", ::atan2}, {"hypot", ::hypot}, {"fmod", ::fmod},
+                  {"fmin", ::fmin}, {"fmax", ::fmax}, {"copysign", ::copysign}};
+    for (auto &entry : binary)
+        add(entry.name, (const void *)entry.function);
+
+    add("fma", (const void *)(Ternary)::fma);
+
+    // Libcalls the optimizer and the backend emit on their own: sin and cos
+    // of one value become sincos, exp2 of an integer becomes ldexp, and
+    // rounding falls back to a call on targets without SSE4.1.
+    add("sincos", (const void *)(void (*)(double, double *, double *))::sincos);
+    add("ldexp", (const void *)(double (*)(double, int))::ldexp);
+    add("frexp", (const void *)(double (*)(double, int *))::frexp);
+    add("modf", (const void *)(double (*)(double, double *))::modf);
+    add("__powidf2", (const void *)__powidf2);
+
+    add("memcpy", (const void *)::memcpy);
+    add("memmove", (const void *)::memmove);
+    add("memset", (const void *)::memset);
+}
+
+orc::SymbolMap getRuntimeSymbols(orc::MangleAndInterner &mangle)
+{
+    orc::SymbolMap symbols;
+    forEachRuntimeSymbol([&](StringRef name, const void *address)
+                         { symbols[mangle(name)] = JITEvaluatedSymbol(pointerToJITTargetAddress(address),
+                                                                      JITSymbolFlags::Exported | JITSymbolFlags::Callable); });
+    return symbols;
+}
+
+bool isRuntimeSymbol(StringRef name)
+{
+    bool found = false;
+    forEachRuntimeSymbol([&](StringRef symbol, const void *)
+                         { found = found || symbol == name; });
+    return found;
+}
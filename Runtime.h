@@ -0,0 +1,16 @@
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/Mangling.h"
+
+// Prints a value as a character or a number and returns 0, so Band code can
+// produce output through `extern putchard(c);` and `extern printd(x);`.
+extern "C" double putchard(double character);
+extern "C" double printd(double value);
+
+// The C functions JIT'd code may call: the libm functions math builtins
+// lower to, further libm functions for extern declarations, the libcalls
+// LLVM itself emits for double math (sincos, ldexp, exp10, __powidf2, ...),
+// the memory functions loop idioms become, and the print helpers above. The JIT only
+// resolves these, instead of every symbol in the process.
+llvm::orc::SymbolMap getRuntimeSymbols(llvm::orc::MangleAndInterner &mangle);
+// Whether name is in that table.
+bool isRuntimeSymbol(llvm::StringRef name);
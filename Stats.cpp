@@ -0,0 +1,186 @@
+#include "AST.h"
+#include "Common.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <map>
+#include <mutex>
+
+using namespace llvm;
+
+bool collectStats = false;
+
+struct FunctionStats
+{
+    double seconds[5] = {};
+    uint64_t codeSize = 0;
+    uint64_t calls = 0;
+};
+
+// Entries of a StringMap never move, so call counters stay in place.
+static StringMap<FunctionStats> functionStats;
+static std::mutex functionStatsMutex;
+
+// The definitions an object defines code for, each with its share of the
+// module's IR, between machine code generation and linking.
+typedef std::vector<std::pair<std::string, double>> Shares;
+static std::map<const MemoryBuffer *, std::pair<std::chrono::steady_clock::time_point, Shares>> compiledObjects;
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The definition a symbol was generated for: f for f, f<x=1>, f.memo.compute
+// and f_map.columns, or nothing for top-level expressions.
+static StringRef getOwner(StringRef symbol)
+{
+    if (symbol.startswith("__"))
+        return StringRef();
+    StringRef owner = symbol.take_until([](char c)
+                                        { return c == '.' || c == '<'; });
+    int name = symbols.find(owner);
+    if (owner.endswith("_map") && (name < 0 || getFunctionArity(name) < 0))
+        owner = owner.drop_back(4);
+    return owner;
+}
+
+static void addShares(const Shares &shares, CompileStage stage, double seconds)
+{
+    std::lock_guard<std::mutex> lock(functionStatsMutex);
+    for (auto &share : shares)
+        functionStats[share.first].seconds[(int)stage] += seconds * share.second;
+}
+
+void addStageTime(StringRef function, CompileStage stage, double seconds)
+{
+    if (function.empty() || function.startswith("__"))
+        return;
+    std::lock_guard<std::mutex> lock(functionStatsMutex);
+    functionStats[function].seconds[(int)stage] += seconds;
+}
+
+uint64_t *getCallCounter(StringRef function)
+{
+    std::lock_guard<std::mutex> lock(functionStatsMutex);
+    return &functionStats[function].calls;
+}
+
+void recordModuleCompiled(const Module &module, const MemoryBuffer &object, std::chrono::steady_clock::time_point start)
+{
+    double seconds = secondsSince(start);
+    StringMap<uint64_t> instructions;
+    uint64_t total = 0;
+    for (const Function &function : module)
+    {
+        StringRef owner = getOwner(function.getName());
+        if (function.isDeclaration() || owner.empty())
+            continue;
+        instructions[owner] += function.getInstructionCount();
+        total += function.getInstructionCount();
+    }
+    if (total == 0)
+        return;
+
+    Shares shares;
+    for (auto &owner : instructions)
+        shares.push_back({owner.getKey().str(), (double)owner.getValue() / total});
+    addShares(shares, CompileStage::Codegen, seconds);
+
+    std::lock_guard<std::mutex> lock(functionStatsMutex);
+    compiledObjects[&object] = {std::chrono::steady_clock::now(), std::move(shares)};
+}
+
+void recordObjectLoaded(const object::ObjectFile &object, const RuntimeDyld::LoadedObjectInfo &info)
+{
+    object::OwningBinary<object::ObjectFile> debugObject = info.getObjectForDebug(object);
+    const object::ObjectFile &loaded = debugObject.getBinary() ? *debugObject.getBinary() : object;
+    for (auto &symbolSize : object::computeSymbolSizes(loaded))
+    {
+        auto type = symbolSize.first.getType();
+        auto name = symbolSize.first.getName();
+        if (!type || !name || *type != object::SymbolRef::ST_Function)
+        {
+            consumeError(type.takeError());
+            consumeError(name.takeError());
+            continue;
+        }
+        recordCodeSize(*name, symbolSize.second);
+    }
+}
+
+void recordCodeSize(StringRef symbol, uint64_t size)
+{
+    StringRef owner = getOwner(symbol);
+    if (owner.empty())
+        return;
+    std::lock_guard<std::mutex> lock(functionStatsMutex);
+    functionStats[owner].codeSize += size;
+}
+
+void recordObjectLinked(const MemoryBuffer &object)
+{
+    std::chrono::steady_clock::time_point compiled;
+    Shares shares;
+    {
+        std::lock_guard<std::mutex> lock(functionStatsMutex);
+        auto objectIter = compiledObjects.find(&object);
+        if (objectIter == compiledObjects.end())
+            return;
+        compiled = objectIter->second.first;
+        shares = std::move(objectIter->second.second);
+        compiledObjects.erase(objectIter);
+    }
+    addShares(shares, CompileStage::Link, secondsSince(compiled));
+}
+
+void printStats(raw_ostream &out)
+{
+    std::lock_guard<std::mutex> lock(functionStatsMutex);
+    std::vector<std::pair<double, StringRef>> rows;
+    for (auto &function : functionStats)
+    {
+        double seconds = 0;
+        for (double stageSeconds : function.getValue().seconds)
+            seconds += stageSeconds;
+        rows.push_back({seconds, function.getKey()});
+    }
+    std::sort(rows.begin(), rows.end(), [](const std::pair<double, StringRef> &a, const std::pair<double, StringRef> &b)
+              { return a.first > b.first; });
+
+    out << "Definition                 parse ms   irgen ms     opt ms codegen ms    link ms   total ms  code bytes          calls\n";
+    for (auto &row : rows)
+    {
+        const FunctionStats &stats = functionStats[row.second];
+        out << format("%-24s %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %11llu %14llu\n", row.second.str().c_str(),
+                      stats.seconds[0] * 1e3, stats.seconds[1] * 1e3, stats.seconds[2] * 1e3, stats.seconds[3] * 1e3,
+                      stats.seconds[4] * 1e3, row.first * 1e3, (unsigned long long)stats.codeSize,
+                      (unsigned long long)stats.calls);
+    }
+}
+
+static const char *const stageNames[][2] = {
+    {"parse", "Parsing"},
+    {"irgen", "IR generation"},
+    {"optimize", "IR optimization"},
+    {"codegen", "Machine code generation"},
+    {"link", "Linking"},
+};
+
+StageTimer::StageTimer(CompileStage stage, StringRef function)
+    : timer(stageNames[(int)stage][0], stageNames[(int)stage][1], "band", "Band compile phases", timePhases),
+      stage(stage), function(function)
+{
+    if (collectStats)
+        this->start = std::chrono::steady_clock::now();
+}
+
+StageTimer::~StageTimer()
+{
+    if (collectStats)
+        addStageTime(this->function, this->stage, secondsSince(this->start));
+}
@@ -0,0 +1,64 @@
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/Support/Timer.h"
+#include <chrono>
+#include <cstdint>
+
+namespace llvm
+{
+    class MemoryBuffer;
+    class Module;
+    class raw_ostream;
+}
+
+// What each definition cost to compile and how often it ran, for --stats.
+// Machine code generation and linking work on whole modules; when a module
+// holds several definitions, their time is split by each definition's share
+// of the module's IR instructions. Clones, memo and column map entries
+// count toward the definition they were generated for.
+enum class CompileStage
+{
+    Parse,
+    IRGen,
+    Optimize,
+    Codegen,
+    Link
+};
+
+// When set, compile stages are timed per definition, code sizes are
+// recorded and generated code counts the calls of every definition.
+extern bool collectStats;
+
+void addStageTime(llvm::StringRef function, CompileStage stage, double seconds);
+// The counter generated code increments on every call of function. It is
+// never freed, so JIT'd code can embed its address.
+uint64_t *getCallCounter(llvm::StringRef function);
+
+// Called by the JIT when module was compiled to object, compilation having
+// started at start; when object was loaded into memory, by RuntimeDyld, or
+// for each function JITLink laid out; and when it was linked.
+void recordModuleCompiled(const llvm::Module &module, const llvm::MemoryBuffer &object,
+                          std::chrono::steady_clock::time_point start);
+void recordObjectLoaded(const llvm::object::ObjectFile &object, const llvm::RuntimeDyld::LoadedObjectInfo &info);
+void recordCodeSize(llvm::StringRef symbol, uint64_t size);
+void recordObjectLinked(const llvm::MemoryBuffer &object);
+
+// Prints a row per definition, the most expensive to compile first.
+void printStats(llvm::raw_ostream &out);
+
+// Times a front-end stage of compiling a definition, for the --time-phases
+// totals and, with --stats, the definition's own row. The definition can be
+// named once it is known, e.g. after it was parsed.
+class StageTimer
+{
+    llvm::NamedRegionTimer timer;
+    CompileStage stage;
+    llvm::StringRef function;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit StageTimer(CompileStage stage, llvm::StringRef function = "");
+    ~StageTimer();
+
+    void setFunction(llvm::StringRef function) { this->function = function; }
+};
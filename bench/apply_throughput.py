@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+"""Measure --apply throughput in rows per second on generated files.
+
+The same rows are written as binary columns of doubles and as CSV text, and
+each is evaluated into binary and CSV output. The summary line --apply
+prints on exit is reported for every run; it times reading, evaluating and
+writing the rows, not compiling the definition.
+"""
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+from array import array
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+DEFINITION = "def f(a b c) if a < b then a*b + c else (a - b)*c;"
+
+
+def generate_files(directory, rows):
+    columns = [array("d", ((i * k) % 1000 * 0.25 for i in range(rows))) for k in (1, 3, 7)]
+    binary_path = os.path.join(directory, "in.bin")
+    with open(binary_path, "wb") as binary:
+        for column in columns:
+            column.tofile(binary)
+    csv_path = os.path.join(directory, "in.csv")
+    with open(csv_path, "w") as text:
+        text.write("a,b,c\n")
+        for row in zip(*columns):
+            text.write("%r,%r,%r\n" % row)
+    return binary_path, csv_path
+
+
+def run(binary, input_path, output_path, chunk_rows):
+    # The CSV header names the columns; binary files are named by --columns.
+    arguments = [binary, "--apply=" + DEFINITION, "--input=" + input_path, "--output=" + output_path,
+                 "--chunk-rows=%d" % chunk_rows]
+    if not input_path.endswith(".csv"):
+        arguments.append("--columns=a,b,c")
+    result = subprocess.run(arguments, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, check=True)
+    for line in result.stderr.decode().splitlines():
+        if line.startswith("Applied"):
+            return line
+    raise RuntimeError("no apply summary in the output")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--binary", default=os.path.join(ROOT, "a.out"))
+    parser.add_argument("--rows", type=int, default=10000000)
+    parser.add_argument("--chunk-rows", type=int, default=65536)
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as directory:
+        binary_path, csv_path = generate_files(directory, args.rows)
+        for input_path in (binary_path, csv_path):
+            for output in ("out.bin", "out.csv"):
+                line = run(args.binary, input_path, os.path.join(directory, output), args.chunk_rows)
+                print("%-6s -> %-7s %s" % (os.path.basename(input_path), output, line))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+"""Report parse+codegen time and peak RSS on a large generated file of defs.
+
+"compile" runs the whole file through -c, which parses and generates IR for
+every def into one module. "retain" uses --tiered with an unreachable
+threshold, so every def is parsed and its AST is kept alive without codegen.
+"""
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+def generate_library(count):
+    lines = []
+    for i in range(count):
+        lines.append("def function%d(alpha beta gamma) if alpha < beta then function%d(alpha, beta*%d.5, gamma) "
+                     "else for i = 0, i < gamma in alpha*beta + gamma*%d;" % (i, max(i - 1, 0), i, i))
+    return "\n".join(lines) + "\n"
+
+
+def run(args):
+    with tempfile.TemporaryFile() as report:
+        start = time.perf_counter()
+        pid = subprocess.Popen(args + ["--time-phases"], stdout=subprocess.DEVNULL, stderr=report).pid
+        _, status, usage = os.wait4(pid, 0)
+        elapsed = time.perf_counter() - start
+        if status != 0:
+            raise RuntimeError("%s exited with %d" % (args, status))
+
+        report.seek(0)
+        phases = {}
+        for match in re.finditer(r"([0-9.]+) \(\s*[0-9.]+%\)\s+([A-Za-z ]+)$", report.read().decode(), re.M):
+            phases[match.group(2).strip()] = float(match.group(1))
+    return elapsed, usage.ru_maxrss / 1024.0, phases
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--binary", default=os.path.join(ROOT, "a.out"))
+    parser.add_argument("--defs", type=int, default=100000)
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as directory:
+        source = os.path.join(directory, "library.band")
+        with open(source, "w") as library:
+            library.write(generate_library(args.defs))
+
+        elapsed, rss, phases = run([args.binary, "-O0", "-c", source, "-o", os.path.join(directory, "library.o")])
+        print("compile %6d defs: parse %.3f s, IR generation %.3f s, total %.3f s, peak RSS %.1f MB"
+              % (args.defs, phases["Parsing"], phases["IR generation"], elapsed, rss))
+
+        elapsed, rss, phases = run([args.binary, "--tiered", "--tier-threshold=4000000000", source])
+        print("retain  %6d defs: parse %.3f s, total %.3f s, peak RSS %.1f MB"
+              % (args.defs, phases["Parsing"], elapsed, rss))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+"""Measure --batch throughput in functions per second on a generated file.
+
+Every def is small and independent, so the front end (parsing and IR
+generation) is a visible part of the cost next to machine code generation.
+The summary line --batch prints on exit is reported for every run.
+"""
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+def generate_file(count):
+    lines = []
+    for i in range(count):
+        lines.append("def g%d(x y) if x < %d then x*%d.5 + y*y - %d else x - y;" % (i, i % 100, i, i))
+    lines.append("g%d(1, 2);" % (count - 1))
+    return "\n".join(lines) + "\n"
+
+
+def run(binary, source_path, extra_args):
+    result = subprocess.run([binary, "--batch=" + source_path] + extra_args, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE, check=True)
+    for line in result.stderr.decode().splitlines():
+        if line.startswith("Batch:"):
+            return line
+    raise RuntimeError("no batch summary in the output")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--binary", default=os.path.join(ROOT, "a.out"))
+    parser.add_argument("--defs", type=int, default=50000)
+    parser.add_argument("--max-threads", type=int, default=os.cpu_count())
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as directory:
+        source_path = os.path.join(directory, "batch.band")
+        with open(source_path, "w") as source:
+            source.write(generate_file(args.defs))
+
+        print("--lazy:                 %s" % run(args.binary, source_path, ["--lazy"]))
+        threads = 1
+        while True:
+            line = run(args.binary, source_path, ["--codegen-threads=%d" % threads, "--compile-threads=%d" % threads])
+            print("%3d codegen threads:    %s" % (threads, line))
+            if threads >= args.max_threads:
+                break
+            threads = min(threads * 2, args.max_threads)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+"""Compare two result files of bench/suite.py and flag regressions.
+
+Prints every metric of every workload the two files share, with the change
+from the baseline. A time or size that grew, or a throughput (*_per_s) that
+fell, by more than --threshold is a regression. Times below --min-seconds in
+the baseline are too short to compare and are only printed. Exits with 1
+if anything regressed.
+"""
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as results:
+        return json.load(results)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=0.10, help="relative change that counts (default 0.10)")
+    parser.add_argument("--min-seconds", type=float, default=0.02,
+                        help="shortest baseline time that is compared (default 0.02)")
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    current = load(args.current)
+    for key in ("scale", "flags"):
+        if baseline.get(key) != current.get(key):
+            print("warning: %s differs: %s vs %s" % (key, baseline.get(key), current.get(key)))
+
+    print("baseline %s, current %s" % (baseline.get("revision"), current.get("revision")))
+    print("%-17s %-13s %12s %12s %8s" % ("workload", "metric", "baseline", "current", "change"))
+    regressions = []
+    for workload, before in sorted(baseline["workloads"].items()):
+        after = current["workloads"].get(workload)
+        if after is None:
+            continue
+        for metric in sorted(before):
+            if metric not in after or before[metric] == 0:
+                continue
+            change = after[metric] / before[metric] - 1
+            higher_is_better = metric.endswith("_per_s")
+            comparable = metric in ("rss_kb",) or higher_is_better or before[metric] >= args.min_seconds
+            worse = -change if higher_is_better else change
+            mark = ""
+            if comparable and worse > args.threshold:
+                mark = "  REGRESSION"
+                regressions.append("%s %s" % (workload, metric))
+            elif comparable and -worse > args.threshold:
+                mark = "  improved"
+            print("%-17s %-13s %12.4g %12.4g %+7.1f%%%s" % (workload, metric, before[metric], after[metric],
+                                                            change * 100, mark))
+
+    if regressions:
+        print("%d regression(s): %s" % (len(regressions), ", ".join(regressions)))
+        return 1
+    print("no regressions above %.0f%%" % (args.threshold * 100))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
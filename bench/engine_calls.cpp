@@ -0,0 +1,43 @@
+// Measures the cost of calling a definition through the embedding API: a
+// kept CompiledFunction, a cached getFunction() per call, and a JIT symbol
+// lookup per call (what the REPL pays for every evaluation).
+#include "../Band.h"
+#include "../Common.h"
+#include <chrono>
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t calls = argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000000;
+    llvm::ExitOnError check("engine_calls: ");
+
+    auto engine = check(band::Engine::create());
+    check(engine->compile("def foo(a b) a*a + 2*a*b + b*b;"));
+
+    auto foo = check(engine->getFunction<double(double, double)>("foo"));
+    double sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < calls; i++)
+        sum += foo(i, 1.0);
+    double direct = secondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < calls; i++)
+        sum += check(engine->getFunction<double(double, double)>("foo"))(i, 1.0);
+    double cached = secondsSince(start);
+
+    uint64_t lookups = calls / 100;
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < lookups; i++)
+        sum += ((double (*)(double, double))check(myJIT->lookup("foo")).getAddress())(i, 1.0);
+    double jitLookup = secondsSince(start) * calls / lookups;
+
+    printf("CompiledFunction:          %8.2f ns/call\n", direct / calls * 1e9);
+    printf("getFunction every call:    %8.2f ns/call\n", cached / calls * 1e9);
+    printf("JIT lookup every call:     %8.2f ns/call\n", jitLookup / calls * 1e9);
+    return sum == 0;
+}
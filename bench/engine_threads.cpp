@@ -0,0 +1,65 @@
+// Stresses one Engine from many threads. Every thread compiles its own
+// definitions, looks them up and calls them, while all threads also call a
+// shared definition compiled up front. Reports compile and call throughput
+// for each thread count.
+#include "../Band.h"
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    unsigned definitions = argc > 1 ? strtoul(argv[1], nullptr, 10) : 256;
+    uint64_t calls = argc > 2 ? strtoull(argv[2], nullptr, 10) : 10000000;
+    llvm::ExitOnError check("engine_threads: ");
+
+    auto engine = check(band::Engine::create());
+    check(engine->compile("def shared(a b) a*a + 2*a*b + b*b;"));
+
+    unsigned round = 0;
+    for (unsigned threads : {1u, 8u, 32u})
+    {
+        std::vector<std::thread> workers;
+        std::vector<double> sums(threads);
+
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned t = 0; t < threads; t++)
+            workers.emplace_back([&, t]
+                                 {
+                for (unsigned i = t; i < definitions; i += threads)
+                {
+                    std::string name = "r" + std::to_string(round) + "f" + std::to_string(i);
+                    check(engine->compile("def " + name + "(x) x*" + std::to_string(i) + " + shared(x, 1);"));
+                    sums[t] += check(engine->getFunction<double(double)>(name))(i);
+                } });
+        for (auto &worker : workers)
+            worker.join();
+        double compileSeconds = secondsSince(start);
+        workers.clear();
+
+        start = std::chrono::steady_clock::now();
+        for (unsigned t = 0; t < threads; t++)
+            workers.emplace_back([&, t]
+                                 {
+                auto shared = check(engine->getFunction<double(double, double)>("shared"));
+                for (uint64_t i = t; i < calls; i += threads)
+                    sums[t] += shared(i, 1.0); });
+        for (auto &worker : workers)
+            worker.join();
+        double callSeconds = secondsSince(start);
+
+        double sum = 0;
+        for (double threadSum : sums)
+            sum += threadSum;
+        printf("%2u threads: %8.0f definitions/s  %8.1f Mcalls/s  (checksum %g)\n", threads,
+               definitions / compileSeconds, calls / callSeconds / 1e6, sum);
+        round++;
+    }
+    return 0;
+}
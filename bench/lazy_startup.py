@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+"""Compare eager and --lazy startup time on a large generated library of defs.
+
+Every helper references the previous one on a branch that is never taken, so
+eager mode compiles the whole chain on the first call while lazy mode only
+compiles the helpers that actually run.
+"""
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+def generate_library(count, used):
+    lines = []
+    for i in range(count):
+        body = " + ".join("x*%d.5*x" % k for k in range(1, 9))
+        if i > 0:
+            lines.append("def helper%d(x) if x < 0 then helper%d(x) + %s else x + %d;" % (i, i - 1, body, i))
+        else:
+            lines.append("def helper%d(x) %s;" % (i, body))
+    for i in range(used):
+        lines.append("helper%d(%d);" % (count - 1 - i, i + 1))
+    return "\n".join(lines) + "\n"
+
+
+def run(binary, source, extra_args):
+    start = time.perf_counter()
+    subprocess.run([binary] + extra_args, input=source.encode(), stdout=subprocess.DEVNULL,
+                   stderr=subprocess.DEVNULL, check=True)
+    return time.perf_counter() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--binary", default=os.path.join(ROOT, "a.out"))
+    parser.add_argument("--defs", type=int, default=500)
+    parser.add_argument("--used", type=int, default=5)
+    parser.add_argument("--repeat", type=int, default=3)
+    args = parser.parse_args()
+
+    source = generate_library(args.defs, args.used)
+    for mode, extra_args in (("eager", []), ("lazy", ["--lazy"])):
+        best = min(run(args.binary, source, extra_args) for _ in range(args.repeat))
+        print("%-5s %5d defs, %3d used: %.3f s" % (mode, args.defs, args.used, best))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+"""Measure lexing throughput (MB/s) on multi-megabyte generated sources.
+
+The file is lexed twice: once memory-mapped (passed as the input file) and
+once line by line from stdin, the way the REPL reads it.
+"""
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+def generate_source(megabytes):
+    lines = []
+    size = 0
+    i = 0
+    while size < megabytes * 1000000:
+        line = ("def function%d(alpha beta) if alpha < %d.25 then for i = 0, i < beta in "
+                "alpha*beta + %d.5 else function%d(alpha - 1, beta) # helper %d\n" % (i, i, i, i, i))
+        lines.append(line)
+        size += len(line)
+        i += 1
+    return "".join(lines)
+
+
+def run(binary, args, stdin=None):
+    result = subprocess.run([binary, "--lex-only"] + args, stdin=stdin, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE, check=True)
+    report = result.stderr.decode()
+    return float(re.search(r"([0-9.]+) MB/s", report).group(1)), report.strip()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--binary", default=os.path.join(ROOT, "a.out"))
+    parser.add_argument("--megabytes", type=int, default=64)
+    parser.add_argument("--repeat", type=int, default=3)
+    args = parser.parse_args()
+
+    with tempfile.NamedTemporaryFile("w", suffix=".band") as source:
+        source.write(generate_source(args.megabytes))
+        source.flush()
+
+        best = max((run(args.binary, [source.name]) for _ in range(args.repeat)), key=lambda r: r[0])
+        print("mmap  %s" % best[1])
+
+        def from_stdin():
+            with open(source.name) as stdin:
+                return run(args.binary, [], stdin)
+        best = max((from_stdin() for _ in range(args.repeat)), key=lambda r: r[0])
+        print("stdin %s" % best[1])
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,40 @@
+// Sums 1..n with a mutable accumulator in Band and with the same loop in
+// C++. Once mem2reg/SROA promote the variables both run the same fadd chain.
+#include "../Band.h"
+#include <chrono>
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Kept out of line so the compiler can not fold the loop into main.
+__attribute__((noinline)) static double sumLoop(double n)
+{
+    double acc = 0;
+    for (double i = 1; i <= n; i += 1)
+        acc += i;
+    return acc;
+}
+
+int main(int argc, char **argv)
+{
+    double n = argc > 1 ? strtod(argv[1], nullptr) : 1e8;
+    llvm::ExitOnError check("loop_sum: ");
+
+    auto engine = check(band::Engine::create());
+    check(engine->compile("def sum(n) var acc = 0 in (for i = 1, i < n in acc = acc + i) : acc;"));
+    auto sum = check(engine->getFunction<double(double)>("sum"));
+
+    auto start = std::chrono::steady_clock::now();
+    double band = sum(n);
+    double bandSeconds = secondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    double native = sumLoop(n);
+    double nativeSeconds = secondsSince(start);
+
+    printf("Band var loop: %8.1f ms  (%g)\n", bandSeconds * 1e3, band);
+    printf("C++ loop:      %8.1f ms  (%g)\n", nativeSeconds * 1e3, native);
+    return band != native;
+}
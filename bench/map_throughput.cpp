@@ -0,0 +1,73 @@
+// Compares calling a JIT-compiled definition once per row through its scalar
+// entry with evaluating whole columns through its vectorized map entry.
+#include "../Parser.h"
+#include "../Lexer.h"
+#include "../Common.h"
+#include <chrono>
+#include <cmath>
+
+static const char *kernelSource =
+    "def kernel(a b) if a < b then a*a + 2*a*b + b*b else a*b - 3*a;";
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t rows = argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000000;
+    int repeat = argc > 2 ? atoi(argv[2]) : 10;
+
+    initializeNativeTargets();
+    initialBinOpPrecs();
+    myJIT = exitOnError(llvm::orc::HadiJIT::Create());
+    initialModulesAndPassManager();
+
+    lexer = std::make_unique<Lexer>(llvm::MemoryBuffer::getMemBuffer(kernelSource));
+    getNextToken();
+    auto definition = parseDefinition();
+    if (!definition || !declareFunction(definition->getPrototype()))
+        return 1;
+    Function *function = definition->codegen();
+    if (!function)
+        return 1;
+    createMapEntry(function);
+    exitOnError(myJIT->addModule(takeCurrentModule()));
+    initialModulesAndPassManager();
+
+    auto scalar = (double (*)(double, double))(intptr_t)exitOnError(myJIT->lookup("kernel")).getAddress();
+    auto columnMap = exitOnError(myJIT->lookupColumnMap("kernel"));
+
+    std::vector<double> a(rows), b(rows), scalarOut(rows), mapOut(rows);
+    for (uint64_t i = 0; i < rows; i++)
+    {
+        a[i] = std::sin((double)i);
+        b[i] = std::cos((double)i * 0.5);
+    }
+    const double *columns[] = {a.data(), b.data()};
+
+    double scalarTime = 1e30, mapTime = 1e30;
+    for (int i = 0; i < repeat; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (uint64_t row = 0; row < rows; row++)
+            scalarOut[row] = scalar(a[row], b[row]);
+        scalarTime = std::min(scalarTime, secondsSince(start));
+
+        start = std::chrono::steady_clock::now();
+        columnMap(columns, mapOut.data(), rows);
+        mapTime = std::min(mapTime, secondsSince(start));
+    }
+
+    for (uint64_t row = 0; row < rows; row++)
+        if (std::fabs(scalarOut[row] - mapOut[row]) > 1e-9 * std::fabs(scalarOut[row]))
+        {
+            fprintf(stderr, "Mismatch at row %llu\n", (unsigned long long)row);
+            return 1;
+        }
+
+    printf("scalar calls: %8.1f M rows/s\n", rows / scalarTime / 1e6);
+    printf("column map:   %8.1f M rows/s (%.1fx)\n", rows / mapTime / 1e6, scalarTime / mapTime);
+    return 0;
+}
@@ -0,0 +1,139 @@
+// Maps sqrt(x*x + 1) over a column three ways: calling the sqrt builtin,
+// which becomes llvm.sqrt and vectorizes, calling the same computation in
+// a host function through an extern, and in a plain C++ loop. Also checks
+// that a builtin applied to a constant is folded away, and that every
+// builtin, and the libcalls LLVM turns some of them into, give libm's
+// result on arguments only known at run time.
+#include "../Band.h"
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double hostNorm(double x)
+{
+    return std::sqrt(x * x + 1);
+}
+
+// Compiles each builtin, plus the sin/cos and exp2-of-a-comparison
+// patterns the optimizer rewrites into sincos and ldexp calls, and compares
+// them with libm over arguments the optimizer can not see.
+static bool checkBuiltins(band::Engine &engine, llvm::ExitOnError &check)
+{
+    struct
+    {
+        const char *name;
+        const char *source;
+        double (*expected)(double, double, double);
+    } cases[] = {
+        {"tsqrt", "def tsqrt(x y z) sqrt(x);", [](double x, double, double) { return std::sqrt(x); }},
+        {"tsin", "def tsin(x y z) sin(x);", [](double x, double, double) { return std::sin(x); }},
+        {"tcos", "def tcos(x y z) cos(x);", [](double x, double, double) { return std::cos(x); }},
+        {"texp", "def texp(x y z) exp(x);", [](double x, double, double) { return std::exp(x); }},
+        {"texp2", "def texp2(x y z) exp2(x);", [](double x, double, double) { return std::exp2(x); }},
+        {"tlog", "def tlog(x y z) log(x);", [](double x, double, double) { return std::log(x); }},
+        {"tlog2", "def tlog2(x y z) log2(x);", [](double x, double, double) { return std::log2(x); }},
+        {"tlog10", "def tlog10(x y z) log10(x);", [](double x, double, double) { return std::log10(x); }},
+        {"tfabs", "def tfabs(x y z) fabs(0 - x);", [](double x, double, double) { return std::fabs(-x); }},
+        {"tfloor", "def tfloor(x y z) floor(x);", [](double x, double, double) { return std::floor(x); }},
+        {"tceil", "def tceil(x y z) ceil(x);", [](double x, double, double) { return std::ceil(x); }},
+        {"ttrunc", "def ttrunc(x y z) trunc(x);", [](double x, double, double) { return std::trunc(x); }},
+        {"tround", "def tround(x y z) round(x);", [](double x, double, double) { return std::round(x); }},
+        {"trint", "def trint(x y z) rint(x);", [](double x, double, double) { return std::rint(x); }},
+        {"tnearbyint", "def tnearbyint(x y z) nearbyint(x);",
+         [](double x, double, double) { return std::nearbyint(x); }},
+        {"tpow", "def tpow(x y z) pow(x, y);", [](double x, double y, double) { return std::pow(x, y); }},
+        {"tfmin", "def tfmin(x y z) fmin(x, y);", [](double x, double y, double) { return std::fmin(x, y); }},
+        {"tfmax", "def tfmax(x y z) fmax(x, y);", [](double x, double y, double) { return std::fmax(x, y); }},
+        {"tcopysign", "def tcopysign(x y z) copysign(x, 0 - y);",
+         [](double x, double y, double) { return std::copysign(x, -y); }},
+        {"tfma", "def tfma(x y z) fma(x, y, z);", [](double x, double y, double z) { return std::fma(x, y, z); }},
+        {"tsincos", "def tsincos(x y z) sin(x) + cos(x);",
+         [](double x, double, double) { return std::sin(x) + std::cos(x); }},
+        {"tldexp", "def tldexp(x y z) exp2(x < y);", [](double x, double y, double) { return x < y ? 2.0 : 1.0; }},
+        {"texp10", "def texp10(x y z) pow(10, y);", [](double, double y, double) { return std::pow(10, y); }},
+    };
+    const double args[][3] = {{0.5, 2, 1}, {2.25, 3, -1}, {7.5, 0.5, 0.25}, {3, 2.5, 4}};
+
+    bool passed = true;
+    for (auto &test : cases)
+    {
+        check(engine.compile(test.source));
+        auto function = check(engine.getFunction<double(double, double, double)>(test.name));
+        for (auto &arg : args)
+        {
+            double result = function(arg[0], arg[1], arg[2]);
+            double expected = test.expected(arg[0], arg[1], arg[2]);
+            if (std::fabs(result - expected) > 1e-12 * std::fmax(1, std::fabs(expected)))
+            {
+                printf("%s(%g, %g, %g) = %.17g, expected %.17g\n", test.name, arg[0], arg[1], arg[2], result,
+                       expected);
+                passed = false;
+            }
+        }
+    }
+
+    // The optimizer would treat a definition named like a libm function as
+    // libm's, so compiling one must fail.
+    if (auto module = engine.compile("def sqrt(x) x*2;"))
+        passed = false;
+    else
+        llvm::consumeError(module.takeError());
+
+    printf("builtins on run-time arguments: %s\n", passed ? "ok" : "FAILED");
+    return passed;
+}
+
+// Kept out of line so the compiler can not specialize it for main's data.
+__attribute__((noinline)) static void normLoop(const double *in, double *out, uint64_t rows)
+{
+    for (uint64_t i = 0; i < rows; i++)
+        out[i] = std::sqrt(in[i] * in[i] + 1);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t rows = argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000000;
+    unsigned repeat = 10;
+    llvm::ExitOnError check("math_builtins: ");
+
+    auto engine = check(band::Engine::create());
+    check(engine->addFunction("hostnorm", hostNorm));
+    check(engine->compile("def builtin(x) sqrt(x*x + 1);"
+                          "extern hostnorm(x);"
+                          "def viaextern(x) hostnorm(x);"
+                          "def folded() fma(sqrt(16), exp(0), pow(2, 10));"));
+
+    bool passed = checkBuiltins(*engine, check);
+
+    std::vector<double> in(rows), out(rows), expected(rows);
+    for (uint64_t i = 0; i < rows; i++)
+        in[i] = (double)(i % 1000) * 0.5;
+    const double *columns[] = {in.data()};
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r < repeat; r++)
+        normLoop(in.data(), expected.data(), rows);
+    double nativeSeconds = secondsSince(start) / repeat;
+
+    for (const char *name : {"builtin", "viaextern"})
+    {
+        auto map = check(engine->getColumnMap(name));
+        start = std::chrono::steady_clock::now();
+        for (unsigned r = 0; r < repeat; r++)
+            map(columns, out.data(), rows);
+        double seconds = secondsSince(start) / repeat;
+
+        passed = passed && out == expected;
+        printf("%-10s %8.1f Mrows/s\n", name, rows / seconds / 1e6);
+    }
+    printf("%-10s %8.1f Mrows/s\n", "C++ loop", rows / nativeSeconds / 1e6);
+
+    double folded = check(engine->getFunction<double()>("folded"))();
+    printf("folded() = %g\n", folded);
+    return passed && folded == 1028 ? 0 : 1;
+}
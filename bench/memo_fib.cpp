@@ -0,0 +1,41 @@
+// Compares naive recursive fibonacci with the same definition as a memo def,
+// and reports the memo cache counters read through the embedding API.
+#include "../Band.h"
+#include <chrono>
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    unsigned maxN = argc > 1 ? strtoul(argv[1], nullptr, 10) : 35;
+    llvm::ExitOnError check("memo_fib: ");
+
+    auto engine = check(band::Engine::create(2, true));
+    check(engine->compile("def fib(n) if n < 2 then n else fib(n-1) + fib(n-2);"
+                          "memo def mfib(n) if n < 2 then n else mfib(n-1) + mfib(n-2);"));
+    auto fib = check(engine->getFunction<double(double)>("fib"));
+    auto mfib = check(engine->getFunction<double(double)>("mfib"));
+
+    printf(" n        def        memo def    hits  misses\n");
+    for (unsigned n = 20; n <= maxN; n += 5)
+    {
+        auto start = std::chrono::steady_clock::now();
+        double plain = fib(n);
+        double plainSeconds = secondsSince(start);
+
+        band::MemoStats before = check(engine->getMemoStats("mfib"));
+        start = std::chrono::steady_clock::now();
+        double memo = mfib(n);
+        double memoSeconds = secondsSince(start);
+        band::MemoStats after = check(engine->getMemoStats("mfib"));
+
+        if (plain != memo)
+            return 1;
+        printf("%2u %10.3f ms %10.3f us %7llu %7llu\n", n, plainSeconds * 1e3, memoSeconds * 1e6,
+               (unsigned long long)(after.hits - before.hits), (unsigned long long)(after.misses - before.misses));
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+"""Measure how batch-load time of a file of defs scales with --compile-threads.
+
+Every def is independent and large enough that machine code generation
+dominates, so the load should get faster as compile threads are added.
+"""
+import argparse
+import os
+import subprocess
+import sys
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+def generate_library(count):
+    lines = []
+    for i in range(count):
+        body = " + ".join("x*%d.5*y - y*%d.25" % (k, k) for k in range(1, 25))
+        lines.append("def kernel%d(x y) if x < %d then %s else y + %d;" % (i, i, body, i))
+    return "\n".join(lines) + "\n"
+
+
+def run(binary, source, extra_args):
+    start = time.perf_counter()
+    subprocess.run([binary] + extra_args, input=source.encode(), stdout=subprocess.DEVNULL,
+                   stderr=subprocess.DEVNULL, check=True)
+    return time.perf_counter() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--binary", default=os.path.join(ROOT, "a.out"))
+    parser.add_argument("--defs", type=int, default=1000)
+    parser.add_argument("--max-threads", type=int, default=os.cpu_count())
+    parser.add_argument("--repeat", type=int, default=3)
+    args = parser.parse_args()
+
+    source = generate_library(args.defs)
+    threads = 1
+    baseline = None
+    while True:
+        best = min(run(args.binary, source, ["--compile-threads=%d" % threads])
+                   for _ in range(args.repeat))
+        baseline = baseline or best
+        print("%3d threads, %5d defs: %.3f s (%.2fx)" % (threads, args.defs, best, baseline / best))
+        if threads >= args.max_threads:
+            break
+        threads = min(threads * 2, args.max_threads)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
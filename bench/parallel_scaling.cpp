@@ -0,0 +1,62 @@
+// Evaluates a definition 10^9 times through Engine::evaluateParallel on 1, 2,
+// 4, ... threads up to every core. The input is a column of 10^7 rows that
+// is swept 100 times, reduced to a sum so nothing is written back. A last
+// sweep writes every result into rows allocated with first touch.
+#include "../Band.h"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+static const char *kernelSource =
+    "def kernel(x) if x < 0.5 then ((x*0.25 + 1)*x - 2)*x + 3 else ((x*0.75 - 1)*x + 2)*x - 3;";
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t evaluations = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000000;
+    uint64_t rows = argc > 2 ? strtoull(argv[2], nullptr, 10) : 10000000;
+    unsigned maxThreads = argc > 3 ? strtoul(argv[3], nullptr, 10) : std::thread::hardware_concurrency();
+    uint64_t sweeps = std::max<uint64_t>(evaluations / rows, 1);
+    llvm::ExitOnError check("parallel_scaling: ");
+
+    auto engine = check(band::Engine::create());
+    check(engine->compile(kernelSource));
+
+    std::vector<double> input(rows);
+    for (uint64_t row = 0; row < rows; row++)
+        input[row] = (row % 1000) / 1000.0;
+    const double *columns[] = {input.data()};
+
+    double baseline = 0;
+    for (unsigned threads = 1;; threads = std::min(threads * 2, maxThreads))
+    {
+        engine->setParallelThreads(threads);
+        double *out = engine->allocateRows(rows);
+
+        auto start = std::chrono::steady_clock::now();
+        double sum = 0;
+        for (uint64_t sweep = 0; sweep < sweeps; sweep++)
+            sum += check(engine->evaluateParallel("kernel", columns, nullptr, rows, band::Reduction::Sum));
+        double seconds = secondsSince(start);
+
+        start = std::chrono::steady_clock::now();
+        check(engine->evaluateParallel("kernel", columns, out, rows));
+        double writeSeconds = secondsSince(start);
+        engine->freeRows(out, rows);
+
+        if (threads == 1)
+            baseline = seconds;
+        printf("%3u threads: %6.3f s for %llu evaluations, %7.1f M/s, %5.2fx  "
+               "(writing: %7.1f M/s, checksum %.6g)\n",
+               threads, seconds, (unsigned long long)(sweeps * rows), sweeps * rows / seconds / 1e6,
+               baseline / seconds, rows / writeSeconds / 1e6, sum);
+        if (threads >= maxThreads)
+            break;
+    }
+    return 0;
+}
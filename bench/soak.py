@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""Feed the REPL a long stream of top-level expressions and track its speed and memory.
+
+A few defs are read first, then --evaluations small top-level expressions
+that call them, each of which the REPL compiles, links, runs and removes.
+Every --interval evaluations the script prints the evaluations so far, the
+evaluations/s over the last interval and overall, the minor page faults per
+evaluation over the interval and the resident set size of the process, read
+from /proc/<pid> (so Linux only). A steady RSS means the JIT gives back what
+each removed expression held; faults count the fresh pages it touched. Pass
+extra flags for the binary after --, e.g. `bench/soak.py -- --rtdyld` to link
+with RuntimeDyld instead of JITLink.
+"""
+import argparse
+import json
+import os
+import subprocess
+import sys
+import threading
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+DEFINITIONS = 20
+
+
+def write_source(stdin, evaluations):
+    for i in range(DEFINITIONS):
+        stdin.write("def k%d(a b) a*a + %d*a*b + b*b;\n" % (i, i))
+    for i in range(evaluations):
+        stdin.write("k%d(%d, %d);\n" % (i % DEFINITIONS, i % 1000, i % 997))
+    stdin.close()
+
+
+def resident_kb(pid):
+    with open("/proc/%d/status" % pid) as status:
+        for line in status:
+            if line.startswith("VmRSS:"):
+                return int(line.split()[1])
+    return 0
+
+
+def minor_faults(pid):
+    with open("/proc/%d/stat" % pid) as stat:
+        # The fields after the parenthesized command name, which may hold spaces.
+        return int(stat.read().rsplit(")", 1)[1].split()[7])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--binary", default=os.path.join(ROOT, "a.out"))
+    parser.add_argument("--evaluations", type=int, default=1000000)
+    parser.add_argument("--interval", type=int, help="evaluations between samples (default: 1/20 of the run)")
+    parser.add_argument("--output", help="file to write the samples to as JSON")
+    parser.add_argument("flags", nargs="*", help="extra flags for the binary, after --")
+    args = parser.parse_args()
+    interval = args.interval or max(1, args.evaluations // 20)
+
+    process = subprocess.Popen([args.binary] + args.flags, stdin=subprocess.PIPE, stdout=subprocess.DEVNULL,
+                               stderr=subprocess.PIPE, universal_newlines=True)
+    writer = threading.Thread(target=write_source, args=(process.stdin, args.evaluations))
+    writer.start()
+
+    print("%12s %10s %14s %14s %10s %10s" % ("evaluations", "seconds", "interval ev/s", "overall ev/s", "faults/ev",
+                                             "RSS MB"))
+    samples = []
+    evaluated = 0
+    start = last = time.perf_counter()
+    faults = minor_faults(process.pid)
+    for line in process.stderr:
+        if not line.startswith("Evaluated to"):
+            if line.startswith("Error"):
+                print(line.rstrip(), file=sys.stderr)
+            continue
+        evaluated += 1
+        if evaluated % interval and evaluated != args.evaluations:
+            continue
+        now = time.perf_counter()
+        previous = samples[-1]["evaluations"] if samples else 0
+        last_faults, faults = faults, minor_faults(process.pid)
+        sample = {
+            "evaluations": evaluated,
+            "seconds": now - start,
+            "interval_per_s": (evaluated - previous) / (now - last),
+            "overall_per_s": evaluated / (now - start),
+            "faults_per_evaluation": (faults - last_faults) / (evaluated - previous),
+            "rss_kb": resident_kb(process.pid),
+        }
+        samples.append(sample)
+        last = now
+        print("%12d %10.1f %14.0f %14.0f %10.2f %10.1f" % (
+            evaluated, sample["seconds"], sample["interval_per_s"], sample["overall_per_s"],
+            sample["faults_per_evaluation"], sample["rss_kb"] / 1024.0))
+        sys.stdout.flush()
+
+    writer.join()
+    if process.wait() != 0 or evaluated != args.evaluations:
+        print("%s stopped after %d of %d evaluations" % (args.binary, evaluated, args.evaluations), file=sys.stderr)
+        return 1
+
+    first, final = samples[0], samples[-1]
+    print("%d evaluations in %.1f s: %.0f evaluations/s, RSS %.1f MB after the first sample and %.1f MB at the end"
+          % (evaluated, final["seconds"], final["overall_per_s"], first["rss_kb"] / 1024.0, final["rss_kb"] / 1024.0))
+    if args.output:
+        with open(args.output, "w") as output:
+            json.dump({"flags": args.flags, "evaluations": evaluated, "samples": samples}, output, indent=2)
+            output.write("\n")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+"""Run the benchmark suite on generated workloads and write the results as JSON.
+
+Every workload is generated from its parameters alone, so two runs of the
+same suite on the same machine measure the same source:
+
+  deep_expressions  defs whose bodies nest binary operators and parentheses
+                    deeply, which stresses the parser and IR generation
+  many_defs         thousands of small defs, each calling the previous one
+  recursive         numeric kernels that recurse: fib, tak, ackermann and a
+                    tail-recursive logistic map, where execution dominates
+  loops             for loops over var accumulators, nested and not
+  repl              a few defs, then thousands of small top-level expressions
+                    read from stdin, each compiled, run and removed
+
+Each workload runs --repeat times with --time-phases --time-phases-json and
+reports, in seconds, the wall time of the whole process and of each phase
+(parse, irgen, optimize, jit, run), its peak RSS in KB, and, from a separate
+--lex-only run on the source repeated to 8 MB, lexing throughput in MB/s. The best of the runs is kept for
+every metric. Compare two result files with bench/compare.py.
+"""
+import argparse
+import json
+import os
+import platform
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+PHASES = ["parse", "irgen", "optimize", "jit", "run"]
+LEX_BYTES = 8000000
+
+
+def nested_expression(depth, i):
+    expression = "x"
+    for level in range(depth):
+        operator = "+-*"[(level + i) % 3]
+        operand = "y" if level % 2 else "%d.5" % (level % 7 + 1)
+        expression = "(%s %s %s)" % (expression, operator, operand)
+    return expression
+
+
+def generate_deep_expressions(scale):
+    count = 50 * scale
+    lines = ["def deep0(x y) x + y;"]
+    for i in range(1, count):
+        lines.append("def deep%d(x y) %s * 0.5 + deep%d(y, x) * 0.25;" % (i, nested_expression(100, i), i - 1))
+    lines.append("deep%d(0.5, 0.25);" % (count - 1))
+    return lines
+
+
+def generate_many_defs(scale):
+    count = 500 * scale
+    lines = ["def f0(a b) a + b;"]
+    for i in range(1, count):
+        lines.append("def f%d(a b) f%d(b, a) * 0.5 + a - %d;" % (i, i - 1, i % 100))
+    lines.append("f%d(1, 2);" % (count - 1))
+    return lines
+
+
+def generate_recursive(scale):
+    return [
+        "def fib(n) if n < 2 then n else fib(n-1) + fib(n-2);",
+        "def tak(x y z) if y < x then tak(tak(x-1, y, z), tak(y-1, z, x), tak(z-1, x, y)) else z;",
+        "def ack(m n) if m < 1 then n + 1 else if n < 1 then ack(m - 1, 1) else ack(m - 1, ack(m, n - 1));",
+        "def logistic(x n) if n < 1 then x else logistic(3.7 * x * (1 - x), n - 1);",
+        "fib(%d);" % (31 + scale),
+        "tak(%d, 16, 8);" % (23 + scale),
+        "ack(3, %d);" % (7 + scale),
+        "logistic(0.5, %d);" % (30000000 * scale),
+    ]
+
+
+def generate_loops(scale):
+    return [
+        "def sum(n) var acc = 0 in (for i = 0, i < n in acc = acc + i * 0.5) : acc;",
+        "def grid(n) var acc = 0 in (for i = 0, i < n in for j = 0, j < n in acc = acc + (i - j) * (i - j)) : acc;",
+        "def poly(n) var acc = 0, x = 0 in (for i = 0, i < n in (x = i / n) : acc = acc + ((x*0.25 + 1)*x - 2)*x) : acc;",
+        "sum(%d);" % (100000000 * scale),
+        "grid(%d);" % (5000 * scale),
+        "poly(%d);" % (50000000 * scale),
+    ]
+
+
+def generate_repl(scale):
+    lines = ["def k%d(a b) a*a + %d*a*b + b*b;" % (i, i) for i in range(20)]
+    for i in range(1000 * scale):
+        lines.append("k%d(%d, %d);" % (i % 20, i, i + 1))
+    return lines
+
+
+# Name, generator and whether the source is read from stdin like the REPL
+# does rather than from a memory-mapped file.
+WORKLOADS = [
+    ("deep_expressions", generate_deep_expressions, False),
+    ("many_defs", generate_many_defs, False),
+    ("recursive", generate_recursive, False),
+    ("loops", generate_loops, False),
+    ("repl", generate_repl, True),
+]
+
+
+def run_process(command, stdin_path):
+    """Runs command and returns its stderr, wall time and peak RSS in KB."""
+    stdin = open(stdin_path) if stdin_path else subprocess.DEVNULL
+    try:
+        start = time.perf_counter()
+        process = subprocess.Popen(command, stdin=stdin, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+        stderr = process.stderr.read().decode()
+        _, status, usage = os.wait4(process.pid, 0)
+        seconds = time.perf_counter() - start
+    finally:
+        if stdin_path:
+            stdin.close()
+    if status != 0:
+        raise RuntimeError("%s failed:\n%s" % (" ".join(command), stderr[-2000:]))
+    return stderr, seconds, usage.ru_maxrss
+
+
+def parse_phases(stderr):
+    report = json.loads(stderr[stderr.index("{"):stderr.rindex("}") + 1])
+    return {phase: report.get("time.band.%s.wall" % phase, 0.0) for phase in PHASES}
+
+
+def run_source(command, path, from_stdin):
+    return run_process(command, path) if from_stdin else run_process(command + [path], None)
+
+
+def measure(binary, path, lex_path, from_stdin, flags):
+    stderr, seconds, rss = run_source([binary, "--time-phases", "--time-phases-json"] + flags, path, from_stdin)
+    result = {"wall": seconds, "rss_kb": rss}
+    result.update(parse_phases(stderr))
+
+    stderr, _, _ = run_source([binary, "--lex-only"], lex_path, from_stdin)
+    result["lex_mb_per_s"] = float(re.search(r"([0-9.]+) MB/s", stderr).group(1))
+    return result
+
+
+def best(runs):
+    """The best value of every metric: the highest of throughputs, named
+    *_per_s, and the lowest of times and sizes."""
+    return {metric: (max if metric.endswith("_per_s") else min)(run[metric] for run in runs) for metric in runs[0]}
+
+
+def git_revision():
+    try:
+        return subprocess.run(["git", "-C", ROOT, "rev-parse", "--short", "HEAD"], stdout=subprocess.PIPE,
+                              stderr=subprocess.DEVNULL, check=True).stdout.decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--binary", default=os.path.join(ROOT, "a.out"))
+    parser.add_argument("--scale", type=int, default=1, help="multiplies the size of every workload")
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--only", help="comma-separated workloads to run")
+    parser.add_argument("--output", help="file to write the JSON results to, instead of stdout")
+    parser.add_argument("flags", nargs="*", help="extra flags for the binary, after --")
+    args = parser.parse_args()
+
+    only = set(args.only.split(",")) if args.only else None
+    results = {
+        "revision": git_revision(),
+        "machine": {"system": platform.platform(), "cpus": os.cpu_count()},
+        "flags": args.flags,
+        "scale": args.scale,
+        "repeat": args.repeat,
+        "workloads": {},
+    }
+    with tempfile.TemporaryDirectory() as directory:
+        for name, generate, from_stdin in WORKLOADS:
+            if only and name not in only:
+                continue
+            text = "\n".join(generate(args.scale)) + "\n"
+            path = os.path.join(directory, name + ".band")
+            with open(path, "w") as source:
+                source.write(text)
+            # Lexing is timed on the source repeated to a few MB, so startup
+            # does not dominate on small workloads.
+            lex_path = os.path.join(directory, name + ".lex.band")
+            with open(lex_path, "w") as source:
+                source.write(text * (LEX_BYTES // len(text) + 1))
+            runs = [measure(args.binary, path, lex_path, from_stdin, args.flags) for _ in range(args.repeat)]
+            results["workloads"][name] = best(runs)
+            summary = results["workloads"][name]
+            print("%-17s %8.3f s  %s  %7.0f MB/s lexing  %7d KB" % (
+                name, summary["wall"], "  ".join("%s %.3f" % (phase, summary[phase]) for phase in PHASES),
+                summary["lex_mb_per_s"], summary["rss_kb"]), file=sys.stderr)
+
+    text = json.dumps(results, indent=2, sort_keys=True) + "\n"
+    if args.output:
+        with open(args.output, "w") as output:
+            output.write(text)
+    else:
+        sys.stdout.write(text)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,58 @@
+// Recurses 10^7 deep through tail calls at every optimization level, on a
+// thread with a 256 KB stack. A stack frame per call would overflow it
+// within a few thousand calls, so finishing shows the recursion became a
+// loop. Exits non-zero if a result is wrong.
+#include "../Band.h"
+#include <chrono>
+#include <pthread.h>
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct Run
+{
+    band::CompiledFunction<double(double, double)> count;
+    band::CompiledFunction<double(double)> down;
+    double depth;
+    bool passed;
+};
+
+static void *runDeep(void *argument)
+{
+    Run &run = *static_cast<Run *>(argument);
+    run.passed = run.count(run.depth, 0) == run.depth && run.down(run.depth + 1) == 0;
+    return nullptr;
+}
+
+int main(int argc, char **argv)
+{
+    double depth = argc > 1 ? strtod(argv[1], nullptr) : 1e7;
+    llvm::ExitOnError check("tail_calls: ");
+
+    bool passed = true;
+    for (unsigned level = 0; level <= 3; level++)
+    {
+        auto engine = check(band::Engine::create(level));
+        check(engine->compile("def count(n acc) if n < 1 then acc else count(n-1, acc+1);"
+                              "def down(n) if n < 1 then 0 else if n < 2 then down(n-1) else down(n-2);"));
+
+        Run run{check(engine->getFunction<double(double, double)>("count")),
+                check(engine->getFunction<double(double)>("down")), depth, false};
+
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+        pthread_attr_setstacksize(&attributes, 256 * 1024);
+        pthread_t thread;
+        auto start = std::chrono::steady_clock::now();
+        if (pthread_create(&thread, &attributes, runDeep, &run))
+            return 1;
+        pthread_join(thread, nullptr);
+        pthread_attr_destroy(&attributes);
+
+        printf("-O%u: %s in %.1f ms\n", level, run.passed ? "passed" : "FAILED", secondsSince(start) * 1e3);
+        passed = passed && run.passed;
+    }
+    return passed ? 0 : 1;
+}
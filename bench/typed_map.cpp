@@ -0,0 +1,121 @@
+// Compares one kernel declared f64 and f32 through its column map, where f32
+// moves half the bytes and fits twice the lanes in a vector register, and a
+// lattice point count over f64 and over i64 loop variables.
+#include "../Parser.h"
+#include "../Lexer.h"
+#include "../Common.h"
+#include <chrono>
+#include <cmath>
+
+static const char *kernelSources[] = {
+    "def kernel64(a b) if a < b then a*a + 2*a*b + b*b else a*b - 3*a;",
+    "def kernel32(a:f32 b:f32):f32 if a < b then a*a + 2*a*b + b*b else a*b - 3*a;",
+    "def latticef64(r) var count = 0 in "
+    "(for i = 0, i < r in for j = 0, j < r in if i*i + j*j < r*r then count = count + 1 else 0) : count;",
+    "def latticei64(r:i64):i64 var count:i64 = 0 in "
+    "(for i:i64 = 0, i < r in for j:i64 = 0, j < r in if i*i + j*j < r*r then count = count + 1 else 0) : count;",
+};
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <typename T>
+static double timeMap(void (*map)(const T *, const T *, T *, uint64_t), const std::vector<T> &a,
+                      const std::vector<T> &b, std::vector<T> &out, int repeat)
+{
+    double best = 1e30;
+    for (int i = 0; i < repeat; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        map(a.data(), b.data(), out.data(), out.size());
+        best = std::min(best, secondsSince(start));
+    }
+    return best;
+}
+
+template <typename T>
+static double timeLattice(T (*lattice)(T), T radius, int repeat, T &count)
+{
+    double best = 1e30;
+    for (int i = 0; i < repeat; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        count = lattice(radius);
+        best = std::min(best, secondsSince(start));
+    }
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t rows = argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000000;
+    int repeat = argc > 2 ? atoi(argv[2]) : 10;
+    int64_t radius = argc > 3 ? strtoll(argv[3], nullptr, 10) : 20000;
+
+    initializeNativeTargets();
+    initialBinOpPrecs();
+    myJIT = exitOnError(llvm::orc::HadiJIT::Create());
+    initialModulesAndPassManager();
+
+    for (const char *source : kernelSources)
+    {
+        lexer = std::make_unique<Lexer>(llvm::MemoryBuffer::getMemBuffer(source));
+        getNextToken();
+        auto definition = parseDefinition();
+        if (!definition || !declareFunction(definition->getPrototype()))
+            return 1;
+        Function *function = definition->codegen();
+        if (!function)
+            return 1;
+        if (definition->getPrototype().getName().startswith("kernel"))
+            createMapEntry(function);
+    }
+    exitOnError(myJIT->addModule(takeCurrentModule()));
+    initialModulesAndPassManager();
+
+    auto map64 = (void (*)(const double *, const double *, double *, uint64_t))(intptr_t)exitOnError(
+                     myJIT->lookup("kernel64_map"))
+                     .getAddress();
+    auto map32 = (void (*)(const float *, const float *, float *, uint64_t))(intptr_t)exitOnError(
+                     myJIT->lookup("kernel32_map"))
+                     .getAddress();
+    auto lattice64 = (double (*)(double))(intptr_t)exitOnError(myJIT->lookup("latticef64")).getAddress();
+    auto latticeI64 = (int64_t (*)(int64_t))(intptr_t)exitOnError(myJIT->lookup("latticei64")).getAddress();
+
+    std::vector<double> a64(rows), b64(rows), out64(rows);
+    std::vector<float> a32(rows), b32(rows), out32(rows);
+    for (uint64_t i = 0; i < rows; i++)
+    {
+        a32[i] = a64[i] = (float)std::sin((double)i);
+        b32[i] = b64[i] = (float)std::cos((double)i * 0.5);
+    }
+
+    double time64 = timeMap(map64, a64, b64, out64, repeat);
+    double time32 = timeMap(map32, a32, b32, out32, repeat);
+    for (uint64_t row = 0; row < rows; row++)
+        if (std::fabs(out64[row] - out32[row]) > 1e-5 * (1 + std::fabs(out64[row])))
+        {
+            fprintf(stderr, "Mismatch at row %llu\n", (unsigned long long)row);
+            return 1;
+        }
+
+    double count64;
+    int64_t countI64;
+    double latticeTime64 = timeLattice(lattice64, (double)radius, repeat, count64);
+    double latticeTimeI64 = timeLattice(latticeI64, radius, repeat, countI64);
+    if (count64 != (double)countI64)
+    {
+        fprintf(stderr, "Lattice counts differ: %.17g and %lld\n", count64, (long long)countI64);
+        return 1;
+    }
+
+    printf("f64 column map: %8.1f M rows/s\n", rows / time64 / 1e6);
+    printf("f32 column map: %8.1f M rows/s (%.2fx)\n", rows / time32 / 1e6, time64 / time32);
+    double points = (double)(radius + 1) * (radius + 1);
+    printf("f64 lattice:    %8.1f M points/s\n", points / latticeTime64 / 1e6);
+    printf("i64 lattice:    %8.1f M points/s (%.2fx, %lld inside)\n", points / latticeTimeI64 / 1e6,
+           latticeTime64 / latticeTimeI64, (long long)countI64);
+    return 0;
+}
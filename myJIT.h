@@ -10,25 +10,200 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/JITLink/EHFrameSupport.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include "JITMemory.h"
+#include "Runtime.h"
+#include "Stats.h"
 #include <memory>
+#include <mutex>
 
 namespace llvm
 {
     namespace orc
     {
 
+        // Keeps compiled objects in CacheDir, named after a hash of the module's
+        // IR and the target it was compiled for. Top-level expressions are not
+        // cached since they are thrown away right after they run.
+        class HadiObjectCache : public ObjectCache
+        {
+        private:
+            std::string CacheDir;
+            std::string TargetKey;
+
+            std::string getCachePath(const Module *M)
+            {
+                std::string IR;
+                raw_string_ostream IROS(IR);
+                M->print(IROS, nullptr);
+
+                SHA1 Hasher;
+                Hasher.update(TargetKey);
+                Hasher.update(IROS.str());
+
+                SmallString<128> Path(CacheDir);
+                sys::path::append(Path, toHex(Hasher.final(), true) + ".o");
+                return std::string(Path);
+            }
+
+        public:
+            HadiObjectCache(std::string CacheDir, std::string TargetKey)
+                : CacheDir(std::move(CacheDir)), TargetKey(std::move(TargetKey)) {}
+
+            void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override
+            {
+                if (M->getFunction("__anon_expr"))
+                    return;
+
+                std::string Path = getCachePath(M);
+                int FD;
+                SmallString<128> TempPath;
+                if (sys::fs::createUniqueFile(Path + ".tmp%%%%%%", FD, TempPath))
+                    return;
+
+                {
+                    raw_fd_ostream TempFile(FD, true);
+                    TempFile << Obj.getBuffer();
+                }
+
+                if (sys::fs::rename(TempPath, Path))
+                    sys::fs::remove(TempPath);
+            }
+
+            std::unique_ptr<MemoryBuffer> getObject(const Module *M) override
+            {
+                if (M->getFunction("__anon_expr"))
+                    return nullptr;
+
+                auto Obj = MemoryBuffer::getFile(getCachePath(M));
+                if (!Obj)
+                    return nullptr;
+
+                return std::move(*Obj);
+            }
+        };
+
+        // Compiles with Compiler and, with --stats, records how long each
+        // module took; see Stats.h.
+        class TimedIRCompiler : public IRCompileLayer::IRCompiler
+        {
+        private:
+            std::unique_ptr<IRCompileLayer::IRCompiler> Compiler;
+
+        public:
+            TimedIRCompiler(std::unique_ptr<IRCompileLayer::IRCompiler> Compiler)
+                : IRCompiler(Compiler->getManglingOptions()), Compiler(std::move(Compiler)) {}
+
+            Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override
+            {
+                if (!collectStats)
+                    return (*Compiler)(M);
+
+                auto Start = std::chrono::steady_clock::now();
+                auto Obj = (*Compiler)(M);
+                if (Obj)
+                    recordModuleCompiled(M, **Obj, Start);
+                return Obj;
+            }
+        };
+
+        // Appends the address, size and name of every loaded function to
+        // /tmp/perf-<pid>.map, where perf looks up symbols of JIT'd code.
+        class PerfMapListener : public JITEventListener
+        {
+        private:
+            std::unique_ptr<raw_fd_ostream> Map;
+            std::mutex Mutex;
+
+        public:
+            PerfMapListener()
+            {
+                std::error_code EC;
+                std::string Path = "/tmp/perf-" + std::to_string(sys::Process::getProcessId()) + ".map";
+                Map = std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Append);
+                if (EC)
+                    Map.reset();
+            }
+
+            void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                                    const RuntimeDyld::LoadedObjectInfo &L) override
+            {
+                if (!Map)
+                    return;
+                object::OwningBinary<object::ObjectFile> DebugObj = L.getObjectForDebug(Obj);
+                if (!DebugObj.getBinary())
+                    return;
+
+                std::lock_guard<std::mutex> Lock(Mutex);
+                for (auto &SymbolSize : object::computeSymbolSizes(*DebugObj.getBinary()))
+                {
+                    auto Type = SymbolSize.first.getType();
+                    auto Name = SymbolSize.first.getName();
+                    auto Address = SymbolSize.first.getAddress();
+                    if (Type && Name && Address && *Type == object::SymbolRef::ST_Function && SymbolSize.second)
+                        *Map << format("%llx %llx ", (unsigned long long)*Address, (unsigned long long)SymbolSize.second)
+                             << *Name << "\n";
+                    consumeError(Type.takeError());
+                    consumeError(Name.takeError());
+                    consumeError(Address.takeError());
+                }
+                Map->flush();
+            }
+        };
+
+        // With --stats, records the size of every function an object defines,
+        // before JITLink drops the unreferenced ones, so clones inlined
+        // everywhere count as they do with RuntimeDyld.
+        class CodeSizePlugin : public ObjectLinkingLayer::Plugin
+        {
+        public:
+            void modifyPassConfig(MaterializationResponsibility &MR, jitlink::LinkGraph &G,
+                                  jitlink::PassConfiguration &Config) override
+            {
+                if (!collectStats)
+                    return;
+                Config.PrePrunePasses.push_back([](jitlink::LinkGraph &G)
+                                                {
+                                                    for (auto *Sym : G.defined_symbols())
+                                                        if (Sym->isCallable() && Sym->hasName())
+                                                            recordCodeSize(Sym->getName(), Sym->getSize());
+                                                    return Error::success(); });
+            }
+
+            Error notifyFailed(MaterializationResponsibility &MR) override { return Error::success(); }
+            Error notifyRemovingResources(ResourceKey K) override { return Error::success(); }
+            void notifyTransferringResources(ResourceKey DstKey, ResourceKey SrcKey) override {}
+        };
+
         class HadiJIT
         {
         private:
@@ -37,39 +212,111 @@ namespace llvm
             DataLayout DL;
             MangleAndInterner Mangle;
 
-            RTDyldObjectLinkingLayer ObjectLayer;
+            std::unique_ptr<LazyCallThroughManager> LCTMgr;
+            std::unique_ptr<ObjectCache> ObjCache;
+
+            // Null when linking with RuntimeDyld, which takes a
+            // SectionMemoryManager per object instead.
+            std::unique_ptr<SlabMemoryManager> MemMgr;
+            std::unique_ptr<ObjectLayer> ObjLayer;
+            RTDyldObjectLinkingLayer *RTDyldLayer = nullptr;
             IRCompileLayer CompileLayer;
+            CompileOnDemandLayer CODLayer;
 
+            JITDylib &RuntimeJD;
             JITDylib &MainJD;
 
+            JITTargetMachineBuilder JTMB;
+            std::unique_ptr<ThreadPool> CompileThreads;
+            std::unique_ptr<PerfMapListener> PerfMap;
+
+            static std::unique_ptr<ObjectLayer> createObjectLayer(ExecutionSession &ES, SlabMemoryManager *MemMgr)
+            {
+                if (MemMgr)
+                    return std::make_unique<ObjectLinkingLayer>(ES, *MemMgr);
+                return std::make_unique<RTDyldObjectLinkingLayer>(ES, []()
+                                                                  { return std::make_unique<SectionMemoryManager>(); });
+            }
+
         public:
             HadiJIT(std::unique_ptr<ExecutionSession> ES,
-                    JITTargetMachineBuilder JTMB, DataLayout DL)
+                    std::unique_ptr<LazyCallThroughManager> LCTMgr,
+                    JITTargetMachineBuilder JTMB, DataLayout DL,
+                    unsigned NumCompileThreads = 0,
+                    std::unique_ptr<ObjectCache> ObjCache = nullptr,
+                    bool UseRuntimeDyld = false)
                 : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
-                  ObjectLayer(*this->ES,
-                              []()
-                              { return std::make_unique<SectionMemoryManager>(); }),
-                  CompileLayer(*this->ES, ObjectLayer,
-                               std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-                  MainJD(this->ES->createBareJITDylib("<main>"))
-            {
-                MainJD.addGenerator(
-                    cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
-                        DL.getGlobalPrefix())));
-                if (JTMB.getTargetTriple().isOSBinFormatCOFF())
+                  LCTMgr(std::move(LCTMgr)), ObjCache(std::move(ObjCache)),
+                  MemMgr(UseRuntimeDyld ? nullptr : std::make_unique<SlabMemoryManager>()),
+                  ObjLayer(createObjectLayer(*this->ES, MemMgr.get())),
+                  CompileLayer(*this->ES, *ObjLayer,
+                               std::make_unique<TimedIRCompiler>(
+                                   std::make_unique<ConcurrentIRCompiler>(JTMB, this->ObjCache.get()))),
+                  CODLayer(*this->ES, CompileLayer, *this->LCTMgr,
+                           createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple())),
+                  RuntimeJD(this->ES->createBareJITDylib("<runtime>")),
+                  MainJD(this->ES->createBareJITDylib("<main>")), JTMB(JTMB)
+            {
+                CODLayer.setPartitionFunction(CompileOnDemandLayer::compileWholeModule);
+                // Definitions resolve against the curated runtime table only,
+                // and shadow it when they reuse one of its names.
+                cantFail(RuntimeJD.define(absoluteSymbols(getRuntimeSymbols(Mangle))));
+                MainJD.addToLinkOrder(RuntimeJD);
+                if (MemMgr)
+                {
+                    auto &Linker = static_cast<ObjectLinkingLayer &>(*ObjLayer);
+                    Linker.addPlugin(std::make_unique<EHFrameRegistrationPlugin>(
+                        *this->ES, std::make_unique<jitlink::InProcessEHFrameRegistrar>()));
+                    Linker.addPlugin(std::make_unique<CodeSizePlugin>());
+                    Linker.setReturnObjectBuffer([](std::unique_ptr<MemoryBuffer> Obj)
+                                                 {
+                                                     if (collectStats)
+                                                         recordObjectLinked(*Obj); });
+                }
+                else
+                {
+                    RTDyldLayer = static_cast<RTDyldObjectLinkingLayer *>(ObjLayer.get());
+                    RTDyldLayer->setNotifyLoaded([](MaterializationResponsibility &, const object::ObjectFile &Obj,
+                                                    const RuntimeDyld::LoadedObjectInfo &Info)
+                                                 {
+                                                     if (collectStats)
+                                                         recordObjectLoaded(Obj, Info); });
+                    RTDyldLayer->setNotifyEmitted([](MaterializationResponsibility &, std::unique_ptr<MemoryBuffer> Obj)
+                                                  {
+                                                      if (collectStats)
+                                                          recordObjectLinked(*Obj); });
+                    if (JTMB.getTargetTriple().isOSBinFormatCOFF())
+                    {
+                        RTDyldLayer->setOverrideObjectFlagsWithResponsibilityFlags(true);
+                        RTDyldLayer->setAutoClaimResponsibilityForObjectSymbols(true);
+                    }
+                }
+
+                if (NumCompileThreads > 0)
                 {
-                    ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
-                    ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
+                    CompileThreads = std::make_unique<ThreadPool>(hardware_concurrency(NumCompileThreads));
+                    this->ES->setDispatchTask([this](std::unique_ptr<Task> T)
+                                              { CompileThreads->async([UnownedT = T.release()]()
+                                                                      { std::unique_ptr<Task> T(UnownedT);
+                                                                        T->run(); }); });
                 }
             }
 
             ~HadiJIT()
             {
+                if (CompileThreads)
+                    CompileThreads->wait();
                 if (auto Err = ES->endSession())
                     ES->reportError(std::move(Err));
             }
 
-            static Expected<std::unique_ptr<HadiJIT>> Create()
+            // Links with JITLink, out of a SlabMemoryManager, unless
+            // useRuntimeDyld is set; the JIT event listeners of
+            // enableEventListeners only work with RuntimeDyld.
+            static Expected<std::unique_ptr<HadiJIT>> Create(CodeGenOpt::Level optLevel = CodeGenOpt::Default,
+                                                             unsigned numCompileThreads = 0,
+                                                             StringRef cacheDir = "",
+                                                             bool useRuntimeDyld = false)
             {
                 auto EPC = SelfExecutorProcessControl::Create();
                 if (!EPC)
@@ -77,21 +324,86 @@ namespace llvm
 
                 auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-                JITTargetMachineBuilder JTMB(
-                    ES->getExecutorProcessControl().getTargetTriple());
+                auto JTMB = JITTargetMachineBuilder::detectHost();
+                if (!JTMB)
+                    return JTMB.takeError();
+                JTMB->setCodeGenOptLevel(optLevel);
+                // JITLink places objects anywhere in the address space and
+                // reaches other objects and the runtime through the GOT and
+                // PLT stubs it builds.
+                if (!useRuntimeDyld)
+                {
+                    JTMB->setRelocationModel(Reloc::PIC_);
+                    JTMB->setCodeModel(CodeModel::Small);
+                }
 
-                auto DL = JTMB.getDefaultDataLayoutForTarget();
+                auto DL = JTMB->getDefaultDataLayoutForTarget();
                 if (!DL)
                     return DL.takeError();
 
-                return std::make_unique<HadiJIT>(std::move(ES), std::move(JTMB),
-                                                 std::move(*DL));
+                auto LCTMgr = createLocalLazyCallThroughManager(JTMB->getTargetTriple(), *ES, 0);
+                if (!LCTMgr)
+                    return LCTMgr.takeError();
+
+                std::unique_ptr<ObjectCache> objCache;
+                if (!cacheDir.empty())
+                {
+                    if (auto EC = sys::fs::create_directories(cacheDir))
+                        return errorCodeToError(EC);
+
+                    std::string targetKey = JTMB->getTargetTriple().str() + "|" + JTMB->getCPU() + "|" +
+                                            JTMB->getFeatures().getString() + "|O" + std::to_string(optLevel) +
+                                            (useRuntimeDyld ? "|rtdyld" : "|jitlink");
+                    objCache = std::make_unique<HadiObjectCache>(cacheDir.str(), std::move(targetKey));
+                }
+
+                return std::make_unique<HadiJIT>(std::move(ES), std::move(*LCTMgr),
+                                                 std::move(*JTMB), std::move(*DL), numCompileThreads,
+                                                 std::move(objCache), useRuntimeDyld);
             }
 
             const DataLayout &getDataLayout() const { return DL; }
 
+            // Reports every object the JIT loads to perf, as a jitdump file
+            // for `perf inject --jit` and in /tmp/perf-<pid>.map, and/or to
+            // GDB's JIT interface. Call before adding modules, on a JIT that
+            // links with RuntimeDyld; does nothing otherwise.
+            void enableEventListeners(bool Perf, bool GDB)
+            {
+                if (!RTDyldLayer)
+                    return;
+                // The listeners read the debug sections, which RuntimeDyld
+                // otherwise does not load.
+                RTDyldLayer->setProcessAllSections(true);
+                if (GDB)
+                    RTDyldLayer->registerJITEventListener(*JITEventListener::createGDBRegistrationListener());
+                if (Perf)
+                {
+                    if (JITEventListener *JITDump = JITEventListener::createPerfJITEventListener())
+                        RTDyldLayer->registerJITEventListener(*JITDump);
+                    PerfMap = std::make_unique<PerfMapListener>();
+                    RTDyldLayer->registerJITEventListener(*PerfMap);
+                }
+            }
+
             JITDylib &getMainJITDylib() { return MainJD; }
 
+            // Lets definitions call a host function through an extern
+            // declaration of Name.
+            Error addRuntimeSymbol(StringRef Name, JITTargetAddress Address)
+            {
+                return RuntimeJD.define(absoluteSymbols(
+                    {{Mangle(Name.str()), JITEvaluatedSymbol(Address, JITSymbolFlags::Exported |
+                                                                          JITSymbolFlags::Callable)}}));
+            }
+
+            // A target machine for the host CPU the JIT compiles for, so IR
+            // passes can use its cost model.
+            Expected<std::unique_ptr<TargetMachine>> createTargetMachine()
+            {
+                return JTMB.createTargetMachine();
+            }
+
             Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr)
             {
                 if (!RT)
@@ -99,10 +411,64 @@ namespace llvm
                 return CompileLayer.add(RT, std::move(TSM));
             }
 
+            // Removes everything added under RT. JITLink interns the name of
+            // every symbol an object defines, locals included, and the pool
+            // keeps names nothing refers to any more until told to drop
+            // them, so a REPL whose expressions define specializations such
+            // as f<x=1> would otherwise keep every such name for good.
+            Error removeModule(ResourceTrackerSP RT)
+            {
+                if (auto Err = RT->remove())
+                    return Err;
+                ES->getSymbolStringPool()->clearDeadEntries();
+                return Error::success();
+            }
+
+            Error addLazyModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr)
+            {
+                if (!RT)
+                    RT = MainJD.getDefaultResourceTracker();
+                return CODLayer.add(RT, std::move(TSM));
+            }
+
+            // Start materializing Name on the compile threads without waiting for it.
+            void compileAhead(StringRef Name)
+            {
+                ES->lookup(LookupKind::Static, makeJITDylibSearchOrder(&MainJD),
+                           SymbolLookupSet(Mangle(Name.str())), SymbolState::Ready,
+                           [this](Expected<SymbolMap> Result)
+                           {
+                               if (!Result)
+                                   ES->reportError(Result.takeError());
+                           },
+                           NoDependenciesToRegister);
+            }
+
             Expected<JITEvaluatedSymbol> lookup(StringRef Name)
             {
                 return ES->lookup({&MainJD}, Mangle(Name.str()));
             }
+
+            // Resolves Name the way an extern call in a definition would.
+            Expected<JITEvaluatedSymbol> lookupExtern(StringRef Name)
+            {
+                return ES->lookup(makeJITDylibSearchOrder({&MainJD, &RuntimeJD}), Mangle(Name.str()));
+            }
+
+            // Evaluates a definition over Rows rows. Columns holds one array per
+            // parameter and Out receives one result per row; Out must not
+            // overlap the columns.
+            using ColumnMapFunction = void (*)(const double *const *Columns, double *Out, uint64_t Rows);
+
+            // Returns the vectorized column entry emitted next to definition Name.
+            // The pointer stays valid as long as the definition is in the JIT.
+            Expected<ColumnMapFunction> lookupColumnMap(StringRef Name)
+            {
+                auto Symbol = lookup((Name + "_map.columns").str());
+                if (!Symbol)
+                    return Symbol.takeError();
+                return reinterpret_cast<ColumnMapFunction>(static_cast<uintptr_t>(Symbol->getAddress()));
+            }
         };
 
     } // end namespace orc